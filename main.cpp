@@ -1,13 +1,37 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <csetjmp>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <sstream>
+#include <thread>
 #include <vector>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <gmpxx.h>
-#include <png++/png.hpp>
+#include <png.h>
 
 using namespace std;
 
@@ -24,25 +48,265 @@ string show_int(mpz_class numerator) {
   return result;
 }
 
+mpz_class read_int(const string& digits) {
+  const int base = 95;
+  const int zero = ' ';
+  mpz_class result;
+  for (const char digit : digits) {
+    if (digit < zero || digit >= zero + base)
+      throw runtime_error("invalid character in encoding");
+    result = result * base + (digit - zero);
+  }
+  return result;
+}
+
+vector<uint8_t> pack_bits(const string& bits) {
+  vector<uint8_t> result((bits.size() + 7) / 8);
+  for (size_t i = 0; i < bits.size(); ++i)
+    if (bits[i] == '1')
+      result[i >> 3] |= 0x80 >> (i & 7);
+  return result;
+}
+
+// Unicode output uses an alphabet of 2^15 code points: CJK Unified
+// Ideographs Extension A through the end of the main CJK block, continued
+// into Hangul Syllables. Every character carries exactly 15 bits, so
+// converting is bit slicing rather than division.
+const size_t unicode_bits = 15;
+const uint32_t unicode_split = 0x6c00;
+
+uint32_t unicode_code_point(const uint32_t digit) {
+  return digit < unicode_split
+    ? 0x3400 + digit
+    : 0xac00 + (digit - unicode_split);
+}
+
+uint32_t unicode_digit(const uint32_t code_point) {
+  if (code_point >= 0x3400 && code_point < 0x3400 + unicode_split)
+    return code_point - 0x3400;
+  if (code_point >= 0xac00 && code_point < 0xac00 + (0x8000 - unicode_split))
+    return code_point - 0xac00 + unicode_split;
+  throw runtime_error("invalid character in encoding");
+}
+
+size_t unicode_size(const size_t bit_count) {
+  return (bit_count + unicode_bits - 1) / unicode_bits * 3;
+}
+
+// Writes the first bit_count bits of the packed buffer as UTF-8 into buffer,
+// which must hold unicode_size(bit_count) bytes. Returns the bytes written.
+size_t show_unicode(
+  const uint8_t* const bytes,
+  const size_t bit_count,
+  char* const buffer,
+  const size_t capacity
+) {
+  if (capacity < unicode_size(bit_count))
+    throw runtime_error("output buffer too small");
+  char* output = buffer;
+  const auto put = [&](const uint32_t digit) {
+    const uint32_t code_point = unicode_code_point(digit);
+    *output++ = char(0xe0 | code_point >> 12);
+    *output++ = char(0x80 | (code_point >> 6 & 0x3f));
+    *output++ = char(0x80 | (code_point & 0x3f));
+  };
+  uint32_t accumulator = 0;
+  size_t pending = 0;
+  for (size_t i = 0; i < (bit_count + 7) / 8; ++i) {
+    accumulator = accumulator << 8 | bytes[i];
+    pending += 8;
+    if (pending >= unicode_bits) {
+      pending -= unicode_bits;
+      put(accumulator >> pending & 0x7fff);
+    }
+  }
+  const size_t padding = (bit_count + 7) / 8 * 8 - bit_count;
+  if (pending > padding)
+    put(accumulator << (unicode_bits - pending) & 0x7fff);
+  return output - buffer;
+}
+
+string read_unicode(const string& text) {
+  string result;
+  for (size_t i = 0; i < text.size(); i += 3) {
+    if (i + 3 > text.size()
+      || (text[i] & 0xf0) != 0xe0
+      || (text[i + 1] & 0xc0) != 0x80
+      || (text[i + 2] & 0xc0) != 0x80)
+      throw runtime_error("invalid UTF-8 in encoding");
+    const uint32_t digit = unicode_digit(uint32_t(text[i] & 0x0f) << 12
+      | uint32_t(text[i + 1] & 0x3f) << 6
+      | uint32_t(text[i + 2] & 0x3f));
+    for (size_t bit = unicode_bits; bit--;)
+      result += digit >> bit & 1 ? '1' : '0';
+  }
+  return result;
+}
+
+// An mmap()ed region, unmapped on destruction.
+class Mapping {
+public:
+
+  Mapping() : address(0), size(0) {}
+
+  Mapping(Mapping&& that) : address(that.address), size(that.size) {
+    that.address = 0;
+    that.size = 0;
+  }
+
+  ~Mapping() {
+    if (address)
+      munmap(address, size);
+  }
+
+  Mapping& operator=(Mapping&& that) {
+    swap(address, that.address);
+    swap(size, that.size);
+    return *this;
+  }
+
+  // Maps a zero-filled, already-unlinked temporary file, so that very large
+  // buffers are paged against the filesystem rather than held in memory.
+  static Mapping temporary(const size_t size) {
+    const char* directory = getenv("TMPDIR");
+    string path(directory ? directory : "/tmp");
+    path += "/twitpng.XXXXXX";
+    const int file = mkstemp(&path[0]);
+    if (file == -1)
+      throw runtime_error("unable to create temporary file");
+    unlink(path.c_str());
+    void* address = MAP_FAILED;
+    if (ftruncate(file, size) == 0)
+      address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    close(file);
+    if (address == MAP_FAILED)
+      throw runtime_error("unable to map temporary file");
+    return Mapping(address, size);
+  }
+
+  // Maps an existing file copy-on-write: reads come straight from the page
+  // cache and writes never reach the file.
+  static Mapping file(const string& filename) {
+    const int file = open(filename.c_str(), O_RDONLY);
+    if (file == -1)
+      throw runtime_error("unable to open " + filename);
+    const off_t size = lseek(file, 0, SEEK_END);
+    void* address = MAP_FAILED;
+    if (size > 0) {
+      address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    }
+    close(file);
+    if (address == MAP_FAILED)
+      throw runtime_error("unable to map " + filename);
+    return Mapping(address, size);
+  }
+
+  uint8_t* get() const { return static_cast<uint8_t*>(address); }
+  size_t get_size() const { return size; }
+
+  explicit operator bool() const { return address; }
+
+private:
+
+  Mapping(void* const address, const size_t size)
+    : address(address), size(size) {}
+
+  Mapping(const Mapping&) = delete;
+  Mapping& operator=(const Mapping&) = delete;
+
+  void* address;
+  size_t size;
+
+};
+
+// A non-owning window onto matrix storage: rows of width elements, stride
+// elements apart.
+template<class T>
+class MatrixView {
+public:
+
+  MatrixView() : data(0), width(0), height(0), stride(0) {}
+
+  MatrixView(
+    T* const data,
+    const size_t width,
+    const size_t height,
+    const size_t stride
+  ) : data(data), width(width), height(height), stride(stride) {}
+
+  template<class U>
+  MatrixView(const MatrixView<U>& that)
+    : data(that.row(0)), width(that.get_width()),
+      height(that.get_height()), stride(that.get_stride()) {}
+
+  T& operator()(const size_t x, const size_t y) const {
+    return data[y * stride + x];
+  }
+
+  T* row(const size_t y) const {
+    return data + y * stride;
+  }
+
+  MatrixView region(
+    const size_t x,
+    const size_t y,
+    const size_t width,
+    const size_t height
+  ) const {
+    return MatrixView(data + y * stride + x, width, height, stride);
+  }
+
+  size_t get_width() const { return width; }
+  size_t get_height() const { return height; }
+  size_t get_stride() const { return stride; }
+
+private:
+
+  T* data;
+  size_t width;
+  size_t height;
+  size_t stride;
+
+};
+
 template<class T>
 class Matrix {
 public:
 
+  // Matrices of at least this many bytes are backed by a temporary file.
+  static const size_t mapping_threshold = size_t(1) << 30;
+
   Matrix() : width(0), height(0), data(0) {}
 
   Matrix(const size_t width, const size_t height)
-    : width(width), height(height), data(new T[width * height]) {
-    fill(data, data + width * height, T());
+    : width(width), height(height), data(0) {
+    allocate();
+  }
+
+  // Adopts width * height elements stored at offset bytes into mapping.
+  Matrix(
+    Mapping&& mapping,
+    const size_t offset,
+    const size_t width,
+    const size_t height
+  ) : width(width), height(height), data(0) {
+    if (offset > mapping.get_size() || (width && height
+      && width > (mapping.get_size() - offset) / height / sizeof(T)))
+      throw runtime_error("file too short for image");
+    data = reinterpret_cast<T*>(mapping.get() + offset);
+    this->mapping = move(mapping);
   }
 
   Matrix(const Matrix& that)
-    : width(that.width), height(that.height) {
-    data = new T[width * height];
-    copy(begin(that.data), end(that.data), begin(data));
+    : width(that.width), height(that.height), data(0) {
+    allocate();
+    copy(that.data, that.data + width * height, data);
   }
 
   Matrix(Matrix&& that)
-    : width(that.width), height(that.height), data(that.data) {
+    : width(that.width), height(that.height),
+      data(that.data), mapping(move(that.mapping)) {
+    that.data = 0;
     that.clear();
   }
 
@@ -58,6 +322,26 @@ public:
     return data[y * width + x];
   }
 
+  const T* row(const size_t y) const {
+    return data + y * width;
+  }
+
+  T* row(const size_t y) {
+    return data + y * width;
+  }
+
+  MatrixView<T> view() {
+    return MatrixView<T>(data, width, height, width);
+  }
+
+  MatrixView<const T> view() const {
+    return MatrixView<const T>(data, width, height, width);
+  }
+
+  operator MatrixView<const T>() const {
+    return view();
+  }
+
   size_t get_width() const { return width; }
   size_t get_height() const { return height; }
 
@@ -66,41 +350,507 @@ private:
   Matrix& operator=(const Matrix&) = delete;
   Matrix& operator=(Matrix&&) = delete;
 
+  void allocate() {
+    const size_t size = width * height;
+    if (size && size >= mapping_threshold / sizeof(T)) {
+      mapping = Mapping::temporary(size * sizeof(T));
+      data = reinterpret_cast<T*>(mapping.get());
+    } else {
+      data = new T[size];
+      fill(data, data + size, T());
+    }
+  }
+
   void clear() {
+    if (!mapping)
+      delete[] data;
+    mapping = Mapping();
     width = height = 0;
-    delete[] data;
+    data = 0;
   }
 
   size_t width;
   size_t height;
 
   T* data;
+  Mapping mapping;
 
 };
 
 template<class T>
 T next_greater_power_of_2(T n) {
   --n;
-  n |= n >> 1;
-  n |= n >> 2;
-  n |= n >> 4;
-  n |= n >> 8;
-  n |= n >> 16;
+  for (size_t shift = 1; shift < sizeof(T) * 8; shift *= 2)
+    n |= n >> shift;
   return n + 1;
 }
 
 template<class T>
-Matrix<T> make_square(const Matrix<T>& input) {
-  const auto width = next_greater_power_of_2(input.get_width());
-  const auto height = next_greater_power_of_2(input.get_height());
-  const auto size = max(width, height);
-  Matrix<T> output(size, size);
-  for (size_t y = 0; y < input.get_height(); ++y)
-    for (size_t x = 0; x < input.get_width(); ++x)
-      output(size * x / width, size * y / height) = input(x, y);
-  return output;
+class SummedArea {
+public:
+
+  SummedArea() {}
+
+  template<class U>
+  explicit SummedArea(const MatrixView<U>& matrix)
+    : sums(matrix.get_width() + 1, matrix.get_height() + 1) {
+    for (size_t y = 0; y < matrix.get_height(); ++y) {
+      T row = T();
+      for (size_t x = 0; x < matrix.get_width(); ++x) {
+        row += matrix(x, y);
+        sums(x + 1, y + 1) = sums(x + 1, y) + row;
+      }
+    }
+  }
+
+  T sum(
+    const size_t x,
+    const size_t y,
+    const size_t width,
+    const size_t height
+  ) const {
+    return sums(x + width, y + height) + sums(x, y)
+      - sums(x + width, y) - sums(x, y + height);
+  }
+
+  bool empty() const { return sums.get_width() < 2; }
+
+private:
+
+  Matrix<T> sums;
+
+};
+
+// Sobel gradient magnitudes, |Gx| + |Gy|, of a row of pixels between the
+// rows above and below it, with the image extended by repeating its border.
+// The AVX2 path produces exactly the same values as the scalar one.
+class SobelFilter {
+public:
+
+  static void filter(
+    const uint8_t* const above,
+    const uint8_t* const middle,
+    const uint8_t* const below,
+    const size_t width,
+    uint16_t* const output
+  ) {
+    output[0]
+      = magnitude(above, middle, below, 0, 0, min<size_t>(1, width - 1));
+    size_t x = 1;
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2"))
+      x = filter_avx2(above, middle, below, width, output);
+#endif
+    for (; x < width; ++x)
+      output[x] = magnitude
+        (above, middle, below, x - 1, x, min(x + 1, width - 1));
+  }
+
+private:
+
+  static uint16_t magnitude(
+    const uint8_t* const above,
+    const uint8_t* const middle,
+    const uint8_t* const below,
+    const size_t left,
+    const size_t x,
+    const size_t right
+  ) {
+    const int dx = above[right] - above[left]
+      + 2 * (middle[right] - middle[left]) + below[right] - below[left];
+    const int dy = below[left] + 2 * below[x] + below[right]
+      - above[left] - 2 * above[x] - above[right];
+    return abs(dx) + abs(dy);
+  }
+
+#ifdef __x86_64__
+  // Filters pixels from 1 in blocks of 16 while their right neighbours are
+  // in the row, and returns where it stopped.
+  __attribute__((target("avx2")))
+  static size_t filter_avx2(
+    const uint8_t* const above,
+    const uint8_t* const middle,
+    const uint8_t* const below,
+    const size_t width,
+    uint16_t* const output
+  ) {
+    size_t x = 1;
+    for (; x + 17 <= width; x += 16) {
+      const __m256i dx = _mm256_add_epi16(_mm256_add_epi16(
+        _mm256_sub_epi16(load16(above + x + 1), load16(above + x - 1)),
+        _mm256_sub_epi16(load16(below + x + 1), load16(below + x - 1))),
+        _mm256_slli_epi16(_mm256_sub_epi16
+          (load16(middle + x + 1), load16(middle + x - 1)), 1));
+      const __m256i dy = _mm256_sub_epi16(
+        _mm256_add_epi16(_mm256_add_epi16
+          (load16(below + x - 1), load16(below + x + 1)),
+          _mm256_slli_epi16(load16(below + x), 1)),
+        _mm256_add_epi16(_mm256_add_epi16
+          (load16(above + x - 1), load16(above + x + 1)),
+          _mm256_slli_epi16(load16(above + x), 1)));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + x),
+        _mm256_add_epi16(_mm256_abs_epi16(dx), _mm256_abs_epi16(dy)));
+    }
+    return x;
+  }
+
+  // Widens 16 bytes to 16-bit lanes.
+  __attribute__((target("avx2")))
+  static __m256i load16(const uint8_t* const bytes) {
+    return _mm256_cvtepu8_epi16
+      (_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes)));
+  }
+#endif
+
+};
+
+// The mean gradient magnitude of the pixels in each cell-by-cell block of the
+// image, over a grid of columns by rows blocks; blocks outside the image are
+// zero. Bands of block rows are filtered on separate threads.
+Matrix<uint16_t> edge_energy(
+  const MatrixView<const uint8_t>& matrix,
+  const size_t cell,
+  const size_t columns,
+  const size_t rows
+) {
+
+  const size_t width = matrix.get_width();
+  const size_t height = matrix.get_height();
+  const size_t block_columns = min(columns, (width + cell - 1) / cell);
+  const size_t block_rows = min(rows, (height + cell - 1) / cell);
+  const size_t thread_count = max<size_t>(1,
+    min<size_t>(thread::hardware_concurrency(), block_rows * cell / 64));
+
+  Matrix<uint16_t> result(columns, rows);
+  vector<thread> threads;
+  for (size_t t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&, t]() {
+      vector<uint16_t> gradient(width);
+      vector<uint64_t> totals(block_columns);
+      const size_t first = block_rows * t / thread_count;
+      const size_t last = block_rows * (t + 1) / thread_count;
+      for (size_t row = first; row < last; ++row) {
+        fill(begin(totals), end(totals), 0);
+        const size_t top = row * cell;
+        const size_t bottom = min(top + cell, height);
+        for (size_t y = top; y < bottom; ++y) {
+          SobelFilter::filter(matrix.row(y ? y - 1 : y), matrix.row(y),
+            matrix.row(y + 1 < height ? y + 1 : y), width, gradient.data());
+          for (size_t column = 0; column < block_columns; ++column) {
+            const size_t right = min((column + 1) * cell, width);
+            for (size_t x = column * cell; x < right; ++x)
+              totals[column] += gradient[x];
+          }
+        }
+        for (size_t column = 0; column < block_columns; ++column) {
+          const size_t pixels = (bottom - top)
+            * (min((column + 1) * cell, width) - column * cell);
+          result(column, row) = totals[column] / pixels;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  return result;
+
+}
+
+// The mean of each cell-by-cell block of the matrix, over a grid of columns
+// by rows blocks; blocks outside the matrix are zero.
+Matrix<uint16_t> block_means(
+  const MatrixView<const uint8_t>& matrix,
+  const size_t cell,
+  const size_t columns,
+  const size_t rows
+) {
+  const size_t width = matrix.get_width();
+  const size_t height = matrix.get_height();
+  Matrix<uint16_t> result(columns, rows);
+  for (size_t row = 0; row * cell < height && row < rows; ++row) {
+    const size_t bottom = min((row + 1) * cell, height);
+    for (size_t column = 0; column * cell < width && column < columns;
+      ++column) {
+      const size_t right = min((column + 1) * cell, width);
+      uint64_t total = 0;
+      for (size_t y = row * cell; y < bottom; ++y)
+        for (size_t x = column * cell; x < right; ++x)
+          total += matrix(x, y);
+      result(column, row)
+        = total / ((bottom - row * cell) * (right - column * cell));
+    }
+  }
+  return result;
+}
+
+typedef array<uint64_t, 256> Histogram;
+
+// Counts the opaque pixels at every step-th row and column.
+Histogram histogram(
+  const MatrixView<const uint8_t>& matrix,
+  const MatrixView<const uint8_t>& mask,
+  const size_t step = 1
+) {
+
+  const size_t width = matrix.get_width();
+  const size_t height = matrix.get_height();
+  const size_t thread_count = max<size_t>(1,
+    min<size_t>(thread::hardware_concurrency(), height / 64));
+
+  // Each thread counts into four interleaved tables so that runs of equal
+  // pixels don't serialize on a single counter.
+  vector<array<array<uint64_t, 256>, 4>> partials(thread_count);
+  vector<thread> threads;
+  for (size_t t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&, t]() {
+      auto& counts = partials[t];
+      for (auto& table : counts)
+        table.fill(0);
+      const size_t first = height * t / thread_count;
+      const size_t last = height * (t + 1) / thread_count;
+      const auto band = matrix.region(0, first, width, last - first);
+      const auto band_mask = mask.get_width()
+        ? mask.region(0, first, width, last - first)
+        : mask;
+      for (size_t y = 0; y < band.get_height(); ++y) {
+        if ((first + y) % step)
+          continue;
+        const uint8_t* row = band.row(y);
+        if (band_mask.get_width() || step > 1) {
+          const uint8_t* opaque
+            = band_mask.get_width() ? band_mask.row(y) : nullptr;
+          for (size_t x = 0; x < width; x += step)
+            counts[x / step & 3][row[x]] += !opaque || opaque[x] != 0;
+          continue;
+        }
+        size_t x = 0;
+        for (; x + 4 <= width; x += 4) {
+          ++counts[0][row[x + 0]];
+          ++counts[1][row[x + 1]];
+          ++counts[2][row[x + 2]];
+          ++counts[3][row[x + 3]];
+        }
+        for (; x < width; ++x)
+          ++counts[0][row[x]];
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  Histogram result;
+  result.fill(0);
+  for (const auto& counts : partials)
+    for (const auto& table : counts)
+      for (size_t i = 0; i < 256; ++i)
+        result[i] += table[i];
+  return result;
+
+}
+
+struct Thresholds {
+
+  Thresholds() : low(255 * 1 / 5), high(255 * 3 / 5) {}
+  Thresholds(const uint8_t low, const uint8_t high) : low(low), high(high) {}
+
+  uint8_t low;
+  uint8_t high;
+
+};
+
+// Three-class Otsu: pick the pair of thresholds maximizing the between-class
+// variance of black [0, low), grey [low, high) and white [high, 256).
+Thresholds otsu_thresholds(const Histogram& histogram) {
+
+  double counts[257] = {0};
+  double sums[257] = {0};
+  for (size_t i = 0; i < 256; ++i) {
+    counts[i + 1] = counts[i] + histogram[i];
+    sums[i + 1] = sums[i] + double(i) * histogram[i];
+  }
+
+  const auto score = [&](const size_t first, const size_t last) {
+    const double count = counts[last] - counts[first];
+    if (!count)
+      return 0.0;
+    const double sum = sums[last] - sums[first];
+    return sum * sum / count;
+  };
+
+  Thresholds result;
+  double best = -1;
+  for (size_t low = 1; low < 255; ++low) {
+    for (size_t high = low + 1; high < 256; ++high) {
+      const double variance
+        = score(0, low) + score(low, high) + score(high, 256);
+      if (variance > best) {
+        best = variance;
+        result = Thresholds(low, high);
+      }
+    }
+  }
+  return result;
+
 }
 
+// Adaptive binary arithmetic coder over a stream of '0'/'1' characters.
+// Probabilities are 12-bit estimates that the next bit is zero.
+class BitEncoder {
+public:
+
+  typedef uint16_t Probability;
+
+  static const Probability initial_probability = 1 << 11;
+
+  explicit BitEncoder(ostream* const stream)
+    : stream(stream), low(0), high(0xffffffff), pending(0), size(0) {}
+
+  void encode(const bool bit, Probability& probability) {
+    const uint32_t split = low
+      + uint32_t((uint64_t(high - low) * probability) >> 12);
+    if (bit) {
+      low = split + 1;
+      probability -= probability >> 5;
+    } else {
+      high = split;
+      probability += (4096 - probability) >> 5;
+    }
+    for (;;) {
+      if (high < half) {
+        emit(false);
+      } else if (low >= half) {
+        emit(true);
+        low -= half;
+        high -= half;
+      } else if (low >= quarter && high < half + quarter) {
+        ++pending;
+        low -= quarter;
+        high -= quarter;
+      } else {
+        break;
+      }
+      low <<= 1;
+      high = high << 1 | 1;
+    }
+  }
+
+  void flush() {
+    ++pending;
+    emit(low >= quarter);
+  }
+
+  size_t get_size() const { return size; }
+
+private:
+
+  void emit(const bool bit) {
+    put(bit);
+    for (; pending; --pending)
+      put(!bit);
+  }
+
+  void put(const bool bit) {
+    if (stream)
+      *stream << (bit ? '1' : '0');
+    ++size;
+  }
+
+  static const uint32_t half = 0x80000000;
+  static const uint32_t quarter = 0x40000000;
+
+  ostream* stream;
+  uint32_t low;
+  uint32_t high;
+  size_t pending;
+  size_t size;
+
+};
+
+class BitDecoder {
+public:
+
+  typedef BitEncoder::Probability Probability;
+
+  explicit BitDecoder(istream& stream)
+    : stream(stream), low(0), high(0xffffffff), value(0) {
+    for (size_t i = 0; i < 32; ++i)
+      value = value << 1 | get();
+  }
+
+  bool decode(Probability& probability) {
+    const uint32_t split = low
+      + uint32_t((uint64_t(high - low) * probability) >> 12);
+    const bool bit = value > split;
+    if (bit) {
+      low = split + 1;
+      probability -= probability >> 5;
+    } else {
+      high = split;
+      probability += (4096 - probability) >> 5;
+    }
+    for (;;) {
+      if (high < half) {
+      } else if (low >= half) {
+        low -= half;
+        high -= half;
+        value -= half;
+      } else if (low >= quarter && high < half + quarter) {
+        low -= quarter;
+        high -= quarter;
+        value -= quarter;
+      } else {
+        break;
+      }
+      low <<= 1;
+      high = high << 1 | 1;
+      value = value << 1 | get();
+    }
+    return bit;
+  }
+
+private:
+
+  uint32_t get() {
+    char bit;
+    return stream.get(bit) && bit == '1' ? 1 : 0;
+  }
+
+  static const uint32_t half = 0x80000000;
+  static const uint32_t quarter = 0x40000000;
+
+  istream& stream;
+  uint32_t low;
+  uint32_t high;
+  uint32_t value;
+
+};
+
+// Count, sum and sum of squares of the samples under a quadtree node.
+struct Statistics {
+
+  Statistics() : count(0), sum(0), squares(0), edges(0), weight(0) {}
+
+  Statistics& operator+=(const Statistics& that) {
+    count += that.count;
+    sum += that.sum;
+    squares += that.squares;
+    edges += that.edges;
+    weight += that.weight;
+    return *this;
+  }
+
+  uint64_t count;
+  uint64_t sum;
+  uint64_t squares;
+
+  // Mean gradient magnitude of the pixels of each sample, summed.
+  uint64_t edges;
+
+  // Mean weight of the pixels of each sample, in sixteenths, summed.
+  uint64_t weight;
+
+};
+
 class QuadTree {
 public:
 
@@ -110,15 +860,26 @@ public:
     GREY_TREE = 1,
     WHITE_TREE = 2,
     SPLIT_TREE = 3,
+    CLEAR_TREE = 4,
   };
 
-  static size_t minimum_cell_size;
+  enum Format {
+    PLAIN_FORMAT = 0,
+    RANGE_FORMAT = 1,
+    PROGRESSIVE_FORMAT = 2,
+    DAG_FORMAT = 3,
+  };
 
-  template<class T>
-  QuadTree(const Matrix<T>& matrix)
-    : type(UNDEFINED_TREE), parent(0) {
-    init(matrix, 0, 0, matrix.get_width(), this);
-  }
+  static Thresholds thresholds;
+  static Format format;
+
+  // How much more a squared error counts under the strongest edges than in
+  // flat regions, less one. Zero leaves edges out of every decision.
+  static double edge_weight;
+
+  // Variation in grey levels, as the gradient estimates it, below which
+  // the builder leaves a node whole. Zero splits every node down to cells.
+  static uint64_t smooth_variation;
 
   size_t encoded_size() const {
     size_t result = 2;
@@ -128,6 +889,7 @@ public:
     case BLACK_TREE:
     case GREY_TREE:
     case WHITE_TREE:
+    case CLEAR_TREE:
       break;
     case SPLIT_TREE:
       for (const auto& child : children)
@@ -137,17 +899,14 @@ public:
     return result;
   }
 
-  mpz_class encode() const {
-    ostringstream stream;
-    encode(stream);
-    return mpz_class(stream.str(), 2);
-  }
-
-  void encode(ostream& stream) const {
-    switch (type) {
+  // CLEAR_TREE leaves are written as the mean of their siblings, or as
+  // fill if they have none.
+  void encode(ostream& stream, const Type fill = BLACK_TREE) const {
+    switch (type == CLEAR_TREE ? fill : type) {
     case UNDEFINED_TREE:
       throw runtime_error("encode() on undefined tree");
     case BLACK_TREE:
+    case CLEAR_TREE:
       stream << "00";
       break;
     case GREY_TREE:
@@ -158,8 +917,9 @@ public:
       break;
     case SPLIT_TREE:
       stream << "11";
+      const Type child_fill = fill_type();
       for (const auto& child : children)
-        child->encode(stream);
+        child->encode(stream, child_fill);
     }
   }
 
@@ -173,45 +933,53 @@ public:
 
     vector<Type> types;
     for (const auto& child : children)
-      types.push_back(child->type);
+      if (child->type != CLEAR_TREE)
+        types.push_back(child->type);
     sort(begin(types), end(types));
     types.erase(unique(begin(types), end(types)), end(types));
 
-    if (types.size() != 1 || types[0] == SPLIT_TREE)
+    if (types.size() > 1 || (types.size() == 1 && types[0] == SPLIT_TREE))
       return;
 
-    type = types[0];
+    type = types.empty() ? CLEAR_TREE : types[0];
+    for (auto& child : children)
+      child.reset();
 
   }
 
-  void simplify() {
+private:
 
-    auto leaves(get_leaves());
-    size_t current_size = encoded_size();
-    size_t last_size = current_size;
-    size_t maximum_detail_loss = 0;
+  friend class Forest;
 
-    while (!leaves.empty() && current_size > maximum_encoded_size) {
+  // Deeper trees than this are corrupt.
+  static const size_t maximum_depth = 64;
 
-      current_size = encoded_size();
+  // The weight of a sample when there is no weight map, in sixteenths.
+  static const uint64_t unit_weight = 16;
 
-      if (last_size == current_size) {
-        ++maximum_detail_loss;
-        if (maximum_detail_loss > 4)
-          throw runtime_error
-            ("image is hopelessly complex; try a smaller cell size");
-      }
+  // Context model for the range-coded payload. Each node is coded as a
+  // split flag followed, for leaves, by a grey flag and a white flag, all
+  // conditioned on depth and on the type of the preceding sibling.
+  struct Model {
 
-      const size_t index = rand() % leaves.size();
-      const auto leaf = leaves[index].lock();
-      if (!merge_with_sibblings(leaf, maximum_detail_loss))
-        continue;
+    static const size_t depths = 16;
+    static const size_t contexts = SPLIT_TREE + 2;
 
+    Model() {
+      for (size_t depth = 0; depth < depths; ++depth) {
+        for (size_t context = 0; context < contexts; ++context) {
+          split[depth][context] = BitEncoder::initial_probability;
+          grey[depth][context] = BitEncoder::initial_probability;
+          white[depth][context] = BitEncoder::initial_probability;
+        }
+      }
     }
 
-  }
+    BitEncoder::Probability split[depths][contexts];
+    BitEncoder::Probability grey[depths][contexts];
+    BitEncoder::Probability white[depths][contexts];
 
-private:
+  };
 
   QuadTree() = delete;
   QuadTree(const QuadTree&) = delete;
@@ -221,51 +989,305 @@ private:
 
   template<class T>
   QuadTree(
-    const Matrix<T>& matrix,
+    const MatrixView<T>& matrix,
+    const SummedArea<uint64_t>& opaque,
+    const SummedArea<uint64_t>& edges,
+    const SummedArea<uint64_t>& weights,
+    const size_t cell,
     const size_t x,
     const size_t y,
     const size_t size,
     QuadTree* const parent
   ) : parent(parent) {
-    init(matrix, x, y, size, this);
+    init(matrix, opaque, edges, weights, cell, x, y, size, this);
   }
 
+  explicit QuadTree(QuadTree* const parent)
+    : type(UNDEFINED_TREE), parent(parent) {}
+
   template<class T>
   void init(
-    const Matrix<T>& matrix,
+    const MatrixView<T>& matrix,
+    const SummedArea<uint64_t>& opaque,
+    const SummedArea<uint64_t>& edges,
+    const SummedArea<uint64_t>& weights,
+    const size_t cell,
     const size_t x,
     const size_t y,
     const size_t size,
     QuadTree* const parent
   ) {
 
-    if (size <= minimum_cell_size) {
+    if (!opaque.empty()
+      && !opaque.sum(x / cell, y / cell, size / cell, size / cell)) {
+      type = CLEAR_TREE;
+      return;
+    }
+
+    if (size <= cell) {
       const auto value = matrix(x, y);
-      type = value < (255 * 1 / 5) ? BLACK_TREE
-        : value < (255 * 3 / 5) ? GREY_TREE
+      type = value < thresholds.low ? BLACK_TREE
+        : value < thresholds.high ? GREY_TREE
         : WHITE_TREE;
+      add_sample(value, edges, weights, x / cell, y / cell);
+      return;
+    }
+
+    // The mean gradient magnitude is about 8 times the slope of the image,
+    // so this estimates how much the samples vary across the node. Where
+    // that is less than smooth_variation, one leaf of their mean stands for
+    // them all.
+    const size_t cells = size / cell;
+    if (smooth_variation && edges.sum(x / cell, y / cell, cells, cells) * size
+      < 8 * smooth_variation * cells * cells) {
+      for (size_t j = 0; j < cells; ++j) {
+        for (size_t i = 0; i < cells; ++i) {
+          if (!opaque.empty()
+            && !opaque.sum(x / cell + i, y / cell + j, 1, 1))
+            continue;
+          add_sample(matrix(x + i * cell, y + j * cell),
+            edges, weights, x / cell + i, y / cell + j);
+        }
+      }
+      type = collapsed_type();
       return;
     }
 
     const auto half = size / 2;
     type = SPLIT_TREE;
-    children[0].reset(new QuadTree(matrix, x, y, half, parent));
-    children[1].reset(new QuadTree(matrix, x + half, y, half, parent));
-    children[2].reset(new QuadTree(matrix, x, y + half, half, parent));
-    children[3].reset(new QuadTree(matrix, x + half, y + half, half, parent));
+    children[0].reset(new QuadTree
+      (matrix, opaque, edges, weights, cell, x, y, half, parent));
+    children[1].reset(new QuadTree
+      (matrix, opaque, edges, weights, cell, x + half, y, half, parent));
+    children[2].reset(new QuadTree
+      (matrix, opaque, edges, weights, cell, x, y + half, half, parent));
+    children[3].reset(new QuadTree
+      (matrix, opaque, edges, weights, cell, x + half, y + half, half, parent));
+    for (const auto& child : children)
+      statistics += child->statistics;
 
   }
 
-  friend ostream& operator<<(ostream& stream, const QuadTree& tree) {
-    switch (tree.type) {
-    case UNDEFINED_TREE:
-      return stream << "undefined";
-    case BLACK_TREE:
-      return stream << ".";
-    case GREY_TREE:
+  // Adds the sample of the cell at x, y, counted in cells.
+  void add_sample(
+    const uint64_t value,
+    const SummedArea<uint64_t>& edges,
+    const SummedArea<uint64_t>& weights,
+    const size_t x,
+    const size_t y
+  ) {
+    ++statistics.count;
+    statistics.sum += value;
+    statistics.squares += value * value;
+    if (!edges.empty())
+      statistics.edges += edges.sum(x, y, 1, 1);
+    statistics.weight
+      += weights.empty() ? unit_weight : weights.sum(x, y, 1, 1);
+  }
+
+  // Appends the node codes (CLEAR_TREE saved as BLACK_TREE) and statistics
+  // of this tree in preorder.
+  void save(vector<uint8_t>& codes, vector<Statistics>& result) const {
+    if (type == UNDEFINED_TREE)
+      throw runtime_error("save() on undefined tree");
+    codes.push_back(type == CLEAR_TREE ? BLACK_TREE : type);
+    result.push_back(statistics);
+    if (type == SPLIT_TREE)
+      for (const auto& child : children)
+        child->save(codes, result);
+  }
+
+  // A leaf with no samples is CLEAR_TREE.
+  void load(
+    const uint8_t* const shapes,
+    const Statistics* const nodes,
+    const size_t count,
+    size_t& index,
+    const size_t depth
+  ) {
+    if (index >= count || depth > maximum_depth)
+      throw runtime_error("invalid tree file");
+    const int code = shapes[index / 4] >> (6 - index % 4 * 2) & 3;
+    statistics = nodes[index++];
+    if (code != SPLIT_TREE) {
+      type = statistics.count ? static_cast<Type>(code) : CLEAR_TREE;
+      return;
+    }
+    type = SPLIT_TREE;
+    for (auto& child : children) {
+      child.reset(new QuadTree(this));
+      child->load(shapes, nodes, count, index, depth + 1);
+    }
+  }
+
+  void encode_range(
+    BitEncoder& encoder,
+    Model& model,
+    const size_t depth,
+    const int previous,
+    const Type fill
+  ) const {
+    const size_t level = min(depth, Model::depths - 1);
+    const Type resolved = type == CLEAR_TREE ? fill : type;
+    switch (resolved) {
+    case UNDEFINED_TREE:
+      throw runtime_error("encode() on undefined tree");
+    case BLACK_TREE:
+    case GREY_TREE:
+    case WHITE_TREE:
+    case CLEAR_TREE:
+      encoder.encode(false, model.split[level][previous]);
+      encoder.encode(resolved == GREY_TREE, model.grey[level][previous]);
+      if (resolved != GREY_TREE)
+        encoder.encode(resolved == WHITE_TREE, model.white[level][previous]);
+      break;
+    case SPLIT_TREE:
+      encoder.encode(true, model.split[level][previous]);
+      const Type child_fill = fill_type();
+      int sibling = SPLIT_TREE + 1;
+      for (const auto& child : children) {
+        child->encode_range(encoder, model, depth + 1, sibling, child_fill);
+        sibling = child->type == CLEAR_TREE ? child_fill : child->type;
+      }
+    }
+  }
+
+  // Decoding stops with an error below maximum_depth or once it would make
+  // more than budget nodes.
+  void decode_plain(istream& stream, const size_t depth, size_t& budget) {
+    if (depth > maximum_depth || !budget)
+      throw runtime_error("encoding describes too large a tree");
+    --budget;
+    switch (read_bits(stream, 2)) {
+    case 0:
+      type = BLACK_TREE;
+      break;
+    case 1:
+      type = GREY_TREE;
+      break;
+    case 2:
+      type = WHITE_TREE;
+      break;
+    case 3:
+      type = SPLIT_TREE;
+      for (auto& child : children) {
+        child.reset(new QuadTree(this));
+        child->decode_plain(stream, depth + 1, budget);
+      }
+    }
+  }
+
+  // Past the end of a corrupt encoding the model can come to predict
+  // nothing but splits, so decoding stops with an error below maximum_depth
+  // or once it would make more than budget nodes.
+  void decode_range(
+    BitDecoder& decoder,
+    Model& model,
+    const size_t depth,
+    const int previous,
+    size_t& budget
+  ) {
+    if (depth > maximum_depth || !budget)
+      throw runtime_error("encoding describes too large a tree");
+    --budget;
+    const size_t level = min(depth, Model::depths - 1);
+    if (decoder.decode(model.split[level][previous])) {
+      type = SPLIT_TREE;
+      int sibling = SPLIT_TREE + 1;
+      for (auto& child : children) {
+        child.reset(new QuadTree(this));
+        child->decode_range(decoder, model, depth + 1, sibling, budget);
+        sibling = child->type;
+      }
+    } else if (decoder.decode(model.grey[level][previous])) {
+      type = GREY_TREE;
+    } else {
+      type = decoder.decode(model.white[level][previous])
+        ? WHITE_TREE : BLACK_TREE;
+    }
+  }
+
+  // A decoded subtree, its node count, and its height.
+  struct DagShape {
+    const QuadTree* tree;
+    size_t nodes;
+    size_t height;
+  };
+
+  // The decoder for Forest::encode_dag(). Split nodes decoded in full are
+  // appended to table as they are finished. References can make a short
+  // encoding describe an enormous tree, so decoding stops with an error
+  // below maximum_depth or once it would make more than budget nodes.
+  DagShape decode_dag(
+    istream& stream,
+    vector<DagShape>& table,
+    const size_t depth,
+    size_t& budget
+  ) {
+    if (depth > maximum_depth || !budget)
+      throw runtime_error("encoding describes too large a tree");
+    --budget;
+    const unsigned long code = read_bits(stream, 2);
+    if (code < SPLIT_TREE) {
+      type = static_cast<Type>(code);
+      return DagShape{this, 1, 0};
+    }
+    type = SPLIT_TREE;
+    if (!read_bits(stream, 1)) {
+      DagShape result = {this, 1, 0};
+      for (auto& child : children) {
+        child.reset(new QuadTree(this));
+        const DagShape shape
+          = child->decode_dag(stream, table, depth + 1, budget);
+        result.nodes += shape.nodes;
+        result.height = max(result.height, shape.height + 1);
+      }
+      table.push_back(result);
+      return result;
+    }
+    const size_t index = read_bits(stream, index_width(table.size()));
+    if (index >= table.size())
+      throw runtime_error("invalid subtree reference");
+    const DagShape shape = table[index];
+    if (depth + shape.height > maximum_depth || shape.nodes - 1 > budget)
+      throw runtime_error("encoding describes too large a tree");
+    budget -= shape.nodes - 1;
+    for (size_t i = 0; i < 4; ++i)
+      children[i] = shape.tree->children[i]->clone(this);
+    return DagShape{this, shape.nodes, shape.height};
+  }
+
+  // Bits needed for an index into a table of count entries.
+  static size_t index_width(const size_t count) {
+    size_t result = 0;
+    while (count > size_t(1) << result)
+      ++result;
+    return result;
+  }
+
+  static unsigned long read_bits(istream& stream, const size_t count) {
+    unsigned long result = 0;
+    for (size_t i = 0; i < count; ++i) {
+      char bit;
+      if (!stream.get(bit))
+        throw runtime_error("truncated encoding");
+      result = result << 1 | (bit == '1');
+    }
+    return result;
+  }
+
+  friend ostream& operator<<(ostream& stream, const QuadTree& tree) {
+    switch (tree.type) {
+    case UNDEFINED_TREE:
+      return stream << "undefined";
+    case BLACK_TREE:
+      return stream << ".";
+    case GREY_TREE:
       return stream << "/";
     case WHITE_TREE:
       return stream << "#";
+    case CLEAR_TREE:
+      return stream << " ";
     case SPLIT_TREE:
       stream << "(";
       for (const auto& child : tree.children)
@@ -281,66 +1303,371 @@ private:
     case BLACK_TREE:
     case GREY_TREE:
     case WHITE_TREE:
+    case CLEAR_TREE:
       return type;
     case SPLIT_TREE:
-      return static_cast<Type>
-        ((static_cast<int>(children[0]->mean_type())
-        + static_cast<int>(children[1]->mean_type())
-        + static_cast<int>(children[2]->mean_type())
-        + static_cast<int>(children[3]->mean_type())) / 4);
+      int sum = 0;
+      int count = 0;
+      for (const auto& child : children) {
+        const Type child_type = child->mean_type();
+        if (child_type != CLEAR_TREE) {
+          sum += static_cast<int>(child_type);
+          ++count;
+        }
+      }
+      return count ? static_cast<Type>(sum / count) : CLEAR_TREE;
     }
   }
 
-  bool merge_with_sibblings(
-    const shared_ptr<QuadTree> tree,
-    const size_t maximum_detail_loss
+  Type fill_type() const {
+    const Type mean = mean_type();
+    return mean == CLEAR_TREE ? BLACK_TREE : mean;
+  }
+
+  // The leaves that simplification may merge: an indexable set with
+  // constant-time insertion and removal.
+  class LeafSet {
+  public:
+
+    bool empty() const { return leaves.empty(); }
+    size_t size() const { return leaves.size(); }
+    QuadTree* operator[](const size_t index) const { return leaves[index]; }
+
+    void insert(QuadTree* const leaf) {
+      leaf->leaf_index = leaves.size();
+      leaves.push_back(leaf);
+    }
+
+    void erase(QuadTree* const leaf) {
+      QuadTree* const last = leaves.back();
+      leaves[leaf->leaf_index] = last;
+      last->leaf_index = leaf->leaf_index;
+      leaves.pop_back();
+    }
+
+    // Adds the leaves under a clone of a tree in this set's source, at the
+    // places they had there, which clone() keeps.
+    void restore(QuadTree* const tree) {
+      for (const auto& child : tree->children) {
+        if (child->type == SPLIT_TREE) {
+          restore(child.get());
+          continue;
+        }
+        if (child->leaf_index >= leaves.size())
+          leaves.resize(child->leaf_index + 1);
+        leaves[child->leaf_index] = child.get();
+      }
+    }
+
+  private:
+
+    vector<QuadTree*> leaves;
+
+  };
+
+  // Collapses the parent of a leaf into a leaf of the mean type of its
+  // children, unless more than maximum_detail_loss of them are split. The
+  // children are freed and the parent takes their place in the leaf set.
+  // Returns the number of nodes freed, or 0 if the merge was refused.
+  static size_t merge_with_sibblings(
+    QuadTree* const tree,
+    const size_t maximum_detail_loss,
+    LeafSet& leaves
   ) {
 
     if (tree->type == SPLIT_TREE || !tree->parent)
       throw runtime_error("merge_with_sibblings() on non-leaf");
 
-    int types[4];
+    QuadTree* const parent = tree->parent;
     size_t sibbling_splits = 0;
+    for (const auto& sibbling : parent->children) {
+      if (!sibbling)
+        throw runtime_error("merge_with_sibblings() with null sibbling");
+      if (sibbling->type == SPLIT_TREE
+        && ++sibbling_splits > maximum_detail_loss)
+        return 0;
+    }
 
-    for (size_t i = 0; i < 4; ++i) {
+    int sum = 0;
+    int count = 0;
+    for (const auto& sibbling : parent->children) {
+      const Type sibbling_type = sibbling->mean_type();
+      if (sibbling_type != CLEAR_TREE) {
+        sum += sibbling_type;
+        ++count;
+      }
+    }
 
-      const auto& sibbling = tree->parent->children[i];
+    const int mean = count ? sum / count : CLEAR_TREE;
+    if (!(mean == BLACK_TREE || mean == GREY_TREE || mean == WHITE_TREE
+      || mean == CLEAR_TREE))
+      throw runtime_error("merge_with_sibblings() merged to invalid type");
 
-      if (!sibbling)
-        throw runtime_error("merge_with_sibblings() with null sibbling");
+    size_t freed = 0;
+    for (auto& sibbling : parent->children) {
+      freed += sibbling->release(leaves);
+      sibbling.reset();
+    }
+    parent->type = static_cast<Type>(mean);
+    if (parent->parent)
+      leaves.insert(parent);
+    return freed;
 
-      if (sibbling->type == SPLIT_TREE) {
+  }
 
-        ++sibbling_splits;
-        if (sibbling_splits > maximum_detail_loss)
-          return false;
+  // Removes the leaves of this tree from the leaf set and returns its node
+  // count.
+  size_t release(LeafSet& leaves) {
+    if (type != SPLIT_TREE) {
+      leaves.erase(this);
+      return 1;
+    }
+    size_t result = 1;
+    for (const auto& child : children)
+      result += child->release(leaves);
+    return result;
+  }
 
-        types[i] = sibbling->mean_type();
+  // Grey level that a leaf of each type stands for: the middle of the range
+  // of levels its class takes under the thresholds, which the encoding
+  // carries, so the decoder draws the same image that is measured here.
+  static uint64_t level(const Type type) {
+    const uint64_t low = thresholds.low;
+    const uint64_t high = thresholds.high;
+    return type == BLACK_TREE ? low / 2
+      : type == GREY_TREE ? (low + high) / 2
+      : min<uint64_t>(255, (high + 256) / 2);
+  }
 
-      } else {
+  // Squared error of the samples under this tree against the levels of the
+  // leaves covering them, each leaf's weighted by its importance as the
+  // simplifiers weigh it. CLEAR_TREE leaves have no samples.
+  uint64_t distortion() const {
+    if (type == SPLIT_TREE) {
+      uint64_t result = 0;
+      for (const auto& child : children)
+        result += child->distortion();
+      return result;
+    }
+    return weighted_error(type);
+  }
 
-        types[i] = sibbling->type;
+  // Squared error of the samples under this tree against a leaf of a type.
+  uint64_t error(const Type leaf) const {
+    if (leaf == CLEAR_TREE)
+      return 0;
+    const uint64_t value = level(leaf);
+    return statistics.squares + statistics.count * value * value
+      - 2 * value * statistics.sum;
+  }
 
-      }
+  // The weight of squared error under this tree: 1 plus edge_weight times
+  // the mean gradient magnitude, relative to that of a step from black to
+  // white.
+  double edge_factor() const {
+    if (!edge_weight || !statistics.count)
+      return 1;
+    return 1 + edge_weight * statistics.edges / statistics.count / 1020;
+  }
+
+  // The mean weight of the samples under this tree.
+  double weight_factor() const {
+    if (!statistics.count)
+      return 1;
+    return double(statistics.weight) / unit_weight / statistics.count;
+  }
+
+  // How much squared error under this tree counts.
+  double importance() const {
+    return edge_factor() * weight_factor();
+  }
+
+  uint64_t weighted_error(const Type leaf) const {
+    const uint64_t result = error(leaf);
+    const double factor = importance();
+    return factor == 1 ? result : uint64_t(result * factor);
+  }
+
+  // The leaf type that stands for the samples under this tree with the
+  // least squared error.
+  Type collapsed_type() const {
+    if (!statistics.count)
+      return CLEAR_TREE;
+    Type result = BLACK_TREE;
+    for (const Type candidate : {GREY_TREE, WHITE_TREE})
+      if (error(candidate) < error(result))
+        result = candidate;
+    return result;
+  }
+
+  // A size in bits of the plain encoding and the squared error that goes
+  // with it.
+  struct RatePoint {
+    uint64_t rate;
+    uint64_t distortion;
+  };
+
+  // The lower convex hull of the points that a tree can be pruned to, by
+  // increasing rate: its operational rate-distortion curve.
+  typedef vector<RatePoint> RateCurve;
 
+  // Subtrees with fewer samples than this are not worth a thread.
+  static const uint64_t parallel_grain = 1 << 14;
+
+  // Runs body(child index, threads) for each child, on threads of their own
+  // if this subtree is large enough and more than one thread is allowed.
+  template<class F>
+  void for_each_child(const size_t threads, const F& body) const {
+    if (threads < 2 || statistics.count < parallel_grain) {
+      for (size_t i = 0; i < 4; ++i)
+        body(i, threads);
+      return;
     }
+    const size_t share = max<size_t>(1, threads / 4);
+    vector<thread> workers;
+    for (size_t i = 1; i < 4; ++i)
+      workers.emplace_back([&body, i, share]() { body(i, share); });
+    body(0, share);
+    for (auto& worker : workers)
+      worker.join();
+  }
 
-    const int mean = (types[0] + types[1] + types[2] + types[3]) / 4;
-    if (!(mean == BLACK_TREE || mean == GREY_TREE || mean == WHITE_TREE))
-      throw runtime_error("merge_with_sibblings() merged to invalid type");
+  // A tree can stay as it is if it is a leaf; otherwise it can collapse
+  // into the best leaf, at 2 bits, or keep its split and prune its children
+  // independently, at 2 bits plus the combined curve of the children.
+  RateCurve rate_curve(const size_t threads) const {
+    if (type != SPLIT_TREE)
+      return RateCurve(1, RatePoint{2, weighted_error(type)});
+    RateCurve curves[4];
+    for_each_child(threads, [&](const size_t i, const size_t share) {
+      curves[i] = children[i]->rate_curve(share);
+    });
+    RateCurve result(1, RatePoint{2, weighted_error(collapsed_type())});
+    for (const auto& point : combine(curves, 4))
+      extend(result, RatePoint{point.rate + 2, point.distortion});
+    return result;
+  }
 
-    tree->parent->type = static_cast<Type>(mean);
-    return true;
-    
+  // Prunes this tree to the point of its curve with the least distortion
+  // plus lambda times rate, and returns that cost. Larger lambdas prune
+  // strictly more, so pruning again with a larger one continues from here.
+  long double prune(const long double lambda, const size_t threads) {
+    if (type != SPLIT_TREE)
+      return weighted_error(type) + 2 * lambda;
+    long double costs[4];
+    for_each_child(threads, [&](const size_t i, const size_t share) {
+      costs[i] = children[i]->prune(lambda, share);
+    });
+    const Type collapsed = collapsed_type();
+    const long double leaf = weighted_error(collapsed) + 2 * lambda;
+    const long double split = 2 * lambda + costs[0] + costs[1] + costs[2]
+      + costs[3];
+    if (split < leaf)
+      return split;
+    for (auto& child : children)
+      child.reset();
+    type = collapsed;
+    return leaf;
+  }
+
+  // The curve of trees pruned independently: from all of them at their
+  // smallest, each step takes the steepest remaining segment of any curve.
+  static RateCurve combine(const RateCurve* const curves, const size_t count) {
+    RatePoint point = {0, 0};
+    for (size_t i = 0; i < count; ++i) {
+      point.rate += curves[i][0].rate;
+      point.distortion += curves[i][0].distortion;
+    }
+    RateCurve result(1, point);
+    vector<size_t> next(count, 1);
+    for (;;) {
+      size_t best = count;
+      for (size_t i = 0; i < count; ++i)
+        if (next[i] < curves[i].size() && (best == count
+          || steeper(&curves[i][next[i]], &curves[best][next[best]])))
+          best = i;
+      if (best == count)
+        return result;
+      const RatePoint* const to = &curves[best][next[best]++];
+      point.rate += to->rate - to[-1].rate;
+      point.distortion -= to[-1].distortion - to->distortion;
+      extend(result, point);
+    }
+  }
+
+  // Whether the segment ending at a loses more distortion per bit than the
+  // one ending at b. Both points follow another in their curves.
+  static bool steeper(const RatePoint* const a, const RatePoint* const b) {
+    return static_cast<long double>(a[-1].distortion - a->distortion)
+      * (b->rate - b[-1].rate)
+      > static_cast<long double>(b[-1].distortion - b->distortion)
+      * (a->rate - a[-1].rate);
+  }
+
+  // Appends a point of greater rate than the last to a lower convex hull,
+  // dropping the points that it shows are not on the hull.
+  static void extend(RateCurve& hull, const RatePoint& point) {
+    if (!hull.empty() && point.distortion >= hull.back().distortion)
+      return;
+    while (hull.size() >= 2) {
+      const RatePoint& first = hull[hull.size() - 2];
+      const RatePoint& last = hull.back();
+      if (static_cast<long double>(first.distortion - last.distortion)
+        * (point.rate - first.rate)
+        > static_cast<long double>(first.distortion - point.distortion)
+        * (last.rate - first.rate))
+        break;
+      hull.pop_back();
+    }
+    hull.push_back(point);
+  }
+
+  // Fills the square of out at x, y with the levels of the leaves.
+  void render(
+    const MatrixView<uint8_t>& out,
+    const size_t x,
+    const size_t y,
+    const size_t size,
+    const Type fill
+  ) const {
+    if (x >= out.get_width() || y >= out.get_height())
+      return;
+    if (type == SPLIT_TREE) {
+      const size_t half = size / 2;
+      const Type child_fill = fill_type();
+      children[0]->render(out, x, y, half, child_fill);
+      children[1]->render(out, x + half, y, half, child_fill);
+      children[2]->render(out, x, y + half, half, child_fill);
+      children[3]->render(out, x + half, y + half, half, child_fill);
+      return;
+    }
+    const uint8_t value = level(type == CLEAR_TREE ? fill : type);
+    const size_t width = min(size, out.get_width() - x);
+    const size_t height = min(size, out.get_height() - y);
+    for (size_t row = 0; row < height; ++row)
+      memset(out.row(y + row) + x, value, width);
   }
 
-  vector<weak_ptr<QuadTree>> get_leaves() {
-    vector<weak_ptr<QuadTree>> result;
-    get_leaves(result);
+  unique_ptr<QuadTree> clone(QuadTree* const parent) const {
+    unique_ptr<QuadTree> result(new QuadTree(parent));
+    result->type = type;
+    result->statistics = statistics;
+    result->leaf_index = leaf_index;
+    if (type == SPLIT_TREE)
+      for (size_t i = 0; i < 4; ++i)
+        result->children[i] = children[i]->clone(result.get());
+    return result;
+  }
+
+  size_t node_count() const {
+    size_t result = 1;
+    if (type == SPLIT_TREE)
+      for (const auto& child : children)
+        result += child->node_count();
     return result;
   }
 
-  void get_leaves(vector<weak_ptr<QuadTree>>& result) {
+  void get_leaves(LeafSet& result) {
     for (const auto& child : children) {
       switch (child->type) {
       case UNDEFINED_TREE:
@@ -348,7 +1675,8 @@ private:
       case BLACK_TREE:
       case GREY_TREE:
       case WHITE_TREE:
-        result.push_back(child);
+      case CLEAR_TREE:
+        result.insert(child.get());
         break;
       case SPLIT_TREE:
         child->get_leaves(result);
@@ -356,54 +1684,2479 @@ private:
     }
   }
 
-  static const size_t maximum_encoded_size = 903;
-
   Type type;
-  shared_ptr<QuadTree> children[4];
+  unique_ptr<QuadTree> children[4];
   QuadTree* parent;
+  Statistics statistics;
+  size_t leaf_index;
 
 };
 
-size_t QuadTree::minimum_cell_size = 64;
+// Lets a caller stop refinement from another thread, or at a deadline.
+class Cancellation {
+public:
 
-int main(int argc, char** argv) try {
-  --argc;
-  ++argv;
-  if (argc < 1 || argc > 2)
-    throw runtime_error("Usage: twitpng filename.png [cell size]");
+  Cancellation()
+    : cancelled(false), deadline(chrono::steady_clock::time_point::max()) {}
+
+  explicit Cancellation(const chrono::steady_clock::time_point deadline)
+    : cancelled(false), deadline(deadline) {}
+
+  void cancel() {
+    cancelled = true;
+  }
+
+  bool is_cancelled() const {
+    return cancelled || chrono::steady_clock::now() >= deadline;
+  }
+
+private:
+
+  atomic<bool> cancelled;
+  chrono::steady_clock::time_point deadline;
+
+};
+
+class Forest {
+public:
+
+  enum Simplifier {
+    RANDOM_SIMPLIFIER,
+    RATE_DISTORTION_SIMPLIFIER,
+  };
+
+  static Simplifier simplifier;
 
-  if (argc == 2) {
-    istringstream stream(argv[1]);
-    if (!(stream >> QuadTree::minimum_cell_size))
+  // Pixels where the mask is zero are "don't care": regions containing only
+  // such samples become CLEAR_TREE leaves that merge with any sibling. The
+  // image is covered by a grid of square roots rather than one padded
+  // square, and whatever of the grid lies outside the image is masked too.
+  // Weights, if given, are those of the pixels in sixteenths, and scale
+  // their squared error in simplification.
+  template<class T>
+  Forest(
+    const MatrixView<T>& matrix,
+    const MatrixView<const uint8_t>& mask,
+    const size_t cell_size,
+    const MatrixView<const uint8_t>& weights = MatrixView<const uint8_t>()
+  ) : threads(max<size_t>(1, thread::hardware_concurrency())) {
+
+    const size_t width = matrix.get_width();
+    const size_t height = matrix.get_height();
+    if (!width || !height)
+      throw runtime_error("empty image");
+    if (!cell_size)
       throw runtime_error("invalid cell size");
+
+    const size_t size = root_size(width, height, cell_size);
+    columns = (width + size - 1) / size;
+    rows = (height + size - 1) / size;
+
+    size_t cell = size;
+    while (cell > cell_size)
+      cell /= 2;
+
+    Matrix<uint8_t> samples(columns * size / cell, rows * size / cell);
+    for (size_t y = 0; y * cell < height; ++y)
+      for (size_t x = 0; x * cell < width; ++x)
+        samples(x, y) = !mask.get_width() || mask(x * cell, y * cell);
+    const SummedArea<uint64_t> opaque(samples.view());
+    const SummedArea<uint64_t> edges
+      (QuadTree::edge_weight || QuadTree::smooth_variation
+      ? SummedArea<uint64_t>(edge_energy(matrix, cell,
+        samples.get_width(), samples.get_height()).view())
+      : SummedArea<uint64_t>());
+    const SummedArea<uint64_t> sample_weights(weights.get_width()
+      ? SummedArea<uint64_t>(block_means(weights, cell,
+        samples.get_width(), samples.get_height()).view())
+      : SummedArea<uint64_t>());
+
+    for (size_t row = 0; row < rows; ++row)
+      for (size_t column = 0; column < columns; ++column)
+        roots.emplace_back(new QuadTree(matrix, opaque, edges, sample_weights,
+          cell, column * size, row * size, size, nullptr));
+
+  }
+
+  // A limit on decoded nodes when the image size is unknown, at about
+  // 400 MB of tree.
+  static const size_t default_maximum_nodes = size_t(1) << 22;
+
+  // More nodes than a tree of an image of the given size can have: the
+  // roots cover less than twice the image in each direction, with at most
+  // one leaf per pixel.
+  static size_t maximum_nodes(const size_t width, const size_t height) {
+    return 6 * width * height + maximum_roots * maximum_roots;
+  }
+
+  // Trees of more than maximum_nodes are refused, as their encoding can
+  // only be corrupt or malicious.
+  static unique_ptr<Forest> decode(
+    const string& bits,
+    const size_t maximum_nodes = default_maximum_nodes
+  ) {
+    istringstream stream(bits);
+    char bit;
+    if (!(stream.get(bit) && bit == '1'))
+      throw runtime_error("missing sentinel bit");
+    const unsigned long header
+      = QuadTree::read_bits(stream, header_size - 1);
+    QuadTree::format = static_cast<QuadTree::Format>(header >> 22);
+    QuadTree::thresholds = Thresholds(header >> 8 & 0xff, header & 0xff);
+    unique_ptr<Forest> forest(new Forest
+      ((header >> 19 & 7) + 1, (header >> 16 & 7) + 1));
+    for (size_t i = 0; i < forest->columns * forest->rows; ++i)
+      forest->roots.emplace_back(new QuadTree(nullptr));
+    switch (QuadTree::format) {
+    case QuadTree::PLAIN_FORMAT:
+      {
+        size_t budget = maximum_nodes;
+        for (const auto& root : forest->roots)
+          root->decode_plain(stream, 0, budget);
+      }
+      break;
+    case QuadTree::RANGE_FORMAT:
+      {
+        BitDecoder decoder(stream);
+        QuadTree::Model model;
+        size_t budget = maximum_nodes;
+        for (const auto& root : forest->roots)
+          root->decode_range
+            (decoder, model, 0, QuadTree::SPLIT_TREE + 1, budget);
+      }
+      break;
+    case QuadTree::PROGRESSIVE_FORMAT:
+      forest->decode_progressive(stream, maximum_nodes);
+      break;
+    case QuadTree::DAG_FORMAT:
+      {
+        vector<QuadTree::DagShape> table;
+        size_t budget = maximum_nodes;
+        for (const auto& root : forest->roots)
+          root->decode_dag(stream, table, 0, budget);
+      }
+      break;
+    default:
+      throw runtime_error("unknown payload format");
+    }
+    return forest;
+  }
+
+  // The full tree, saved after merge_leaves() so that it can be simplified
+  // again for another budget without reading the image. After the header
+  // come the preorder index of each root, the node codes at 2 bits each
+  // padded to 8 bytes, and the statistics of each node, all in native byte
+  // order.
+  void save(const string& filename) const {
+    vector<uint8_t> codes;
+    vector<Statistics> statistics;
+    vector<uint64_t> offsets;
+    for (const auto& root : roots) {
+      offsets.push_back(codes.size());
+      root->save(codes, statistics);
+    }
+    vector<uint8_t> shapes((codes.size() + 31) / 32 * 8);
+    for (size_t i = 0; i < codes.size(); ++i)
+      shapes[i / 4] |= codes[i] << (6 - i % 4 * 2);
+    TreeHeader header;
+    copy(begin(tree_magic), end(tree_magic), header.magic);
+    header.version = tree_version;
+    header.columns = columns;
+    header.rows = rows;
+    header.low = QuadTree::thresholds.low;
+    header.high = QuadTree::thresholds.high;
+    header.nodes = codes.size();
+    FILE* const file = fopen(filename.c_str(), "wb");
+    if (!file)
+      throw runtime_error("unable to open " + filename);
+    const bool written = fwrite(&header, sizeof header, 1, file) == 1
+      && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file)
+        == offsets.size()
+      && fwrite(shapes.data(), 1, shapes.size(), file) == shapes.size()
+      && fwrite(statistics.data(), sizeof(Statistics), statistics.size(), file)
+        == statistics.size();
+    if (fclose(file) != 0 || !written)
+      throw runtime_error("unable to write " + filename);
+  }
+
+  static unique_ptr<Forest> load(const Mapping& file) {
+    const uint8_t* const data = file.get();
+    const size_t size = file.get_size();
+    TreeHeader header;
+    if (size < sizeof header)
+      throw runtime_error("invalid tree file");
+    memcpy(&header, data, sizeof header);
+    if (!equal(begin(tree_magic), end(tree_magic), header.magic))
+      throw runtime_error("invalid tree file");
+    if (header.version != tree_version)
+      throw runtime_error("unsupported tree file version");
+    if (!header.columns || header.columns > maximum_roots
+      || !header.rows || header.rows > maximum_roots
+      || header.nodes > size)
+      throw runtime_error("invalid tree file");
+    const size_t count = header.columns * header.rows;
+    const size_t nodes = header.nodes;
+    const size_t shapes_offset = sizeof header + count * sizeof(uint64_t);
+    const size_t statistics_offset = shapes_offset + (nodes + 31) / 32 * 8;
+    if (statistics_offset + nodes * sizeof(Statistics) != size)
+      throw runtime_error("invalid tree file");
+    const uint64_t* const offsets
+      = reinterpret_cast<const uint64_t*>(data + sizeof header);
+    const Statistics* const statistics
+      = reinterpret_cast<const Statistics*>(data + statistics_offset);
+    QuadTree::thresholds = Thresholds(header.low, header.high);
+    unique_ptr<Forest> forest(new Forest(header.columns, header.rows));
+    for (size_t i = 0; i < count; ++i) {
+      size_t index = offsets[i];
+      forest->roots.emplace_back(new QuadTree(nullptr));
+      forest->roots.back()->load
+        (data + shapes_offset, statistics, nodes, index, 0);
+      if (index != (i + 1 < count ? offsets[i + 1] : nodes))
+        throw runtime_error("invalid tree file");
+    }
+    return forest;
+  }
+
+  size_t encoded_size() const {
+    return header_size + payload_size();
+  }
+
+  size_t payload_size() const {
+    size_t result = 0;
+    switch (QuadTree::format) {
+    case QuadTree::PLAIN_FORMAT:
+      for (const auto& root : roots)
+        result += root->encoded_size();
+      break;
+    case QuadTree::RANGE_FORMAT:
+      {
+        BitEncoder encoder(nullptr);
+        QuadTree::Model model;
+        for (const auto& root : roots)
+          root->encode_range
+            (encoder, model, 0, QuadTree::SPLIT_TREE + 1, QuadTree::BLACK_TREE);
+        encoder.flush();
+        result = encoder.get_size();
+      }
+      break;
+    case QuadTree::PROGRESSIVE_FORMAT:
+      {
+        ostringstream stream;
+        encode_progressive(stream);
+        result = stream.tellp();
+      }
+      break;
+    case QuadTree::DAG_FORMAT:
+      {
+        ostringstream stream;
+        encode_dag(stream);
+        result = stream.tellp();
+      }
+      break;
+    }
+    return result;
+  }
+
+  mpz_class encode() const {
+    return mpz_class(encode_bits(), 2);
+  }
+
+  string encode_bits() const {
+    ostringstream stream;
+    stream << '1' << bitset<2>(QuadTree::format)
+      << bitset<3>(columns - 1) << bitset<3>(rows - 1)
+      << bitset<8>(QuadTree::thresholds.low)
+      << bitset<8>(QuadTree::thresholds.high);
+    switch (QuadTree::format) {
+    case QuadTree::PLAIN_FORMAT:
+      for (const auto& root : roots)
+        root->encode(stream);
+      break;
+    case QuadTree::RANGE_FORMAT:
+      {
+        BitEncoder encoder(&stream);
+        QuadTree::Model model;
+        for (const auto& root : roots)
+          root->encode_range
+            (encoder, model, 0, QuadTree::SPLIT_TREE + 1, QuadTree::BLACK_TREE);
+        encoder.flush();
+      }
+      break;
+    case QuadTree::PROGRESSIVE_FORMAT:
+      encode_progressive(stream);
+      break;
+    case QuadTree::DAG_FORMAT:
+      encode_dag(stream);
+      break;
+    }
+    return stream.str();
+  }
+
+  void merge_leaves() {
+    for (const auto& root : roots)
+      root->merge_leaves();
+  }
+
+  unique_ptr<Forest> clone() const {
+    unique_ptr<Forest> result(new Forest(columns, rows));
+    result->threads = threads;
+    for (const auto& root : roots)
+      result->roots.push_back(root->clone(nullptr));
+    return result;
+  }
+
+  // Seeds the merge order of simplify().
+  void seed(const mt19937::result_type value) {
+    random.seed(value);
+  }
+
+  // The number of threads that work on the forest may use, by default one
+  // per core. Clones inherit it.
+  size_t get_threads() const {
+    return threads;
+  }
+
+  void set_threads(const size_t count) {
+    threads = max<size_t>(1, count);
+  }
+
+  // Draws the forest over an image of the given size, using the smallest
+  // root size that covers it with this many roots, as the constructor did.
+  Matrix<uint8_t> render(const size_t width, const size_t height) const {
+    size_t size = 1;
+    while ((width + size - 1) / size > columns
+      || (height + size - 1) / size > rows)
+      size *= 2;
+    Matrix<uint8_t> result(width, height);
+    for (size_t row = 0; row < rows; ++row)
+      for (size_t column = 0; column < columns; ++column)
+        roots[row * columns + column]->render(result.view(),
+          column * size, row * size, size, QuadTree::BLACK_TREE);
+    return result;
   }
 
-  cerr << "Reading " << argv[0] << '\n';
-  png::image<png::ga_pixel> image;
-  try {
-    image.read(argv[0], png::convert_color_space<png::ga_pixel>());
-  } catch (const exception&) {}
+  // Squared error of the image samples against the simplified tree,
+  // weighted by importance.
+  uint64_t distortion() const {
+    uint64_t result = 0;
+    for (const auto& root : roots)
+      result += root->distortion();
+    return result;
+  }
+
+  // Merges leaves at random until the encoding fits in maximum_size bits,
+  // or prunes with optimize() if that is the simplifier. Simplifying again
+  // to a smaller size continues from the current tree. Returns false,
+  // leaving the tree partly simplified, if cancelled, and throws if the
+  // encoding cannot be made to fit.
+  bool simplify(
+    const size_t maximum_size,
+    const Cancellation* const cancellation = nullptr
+  ) {
+
+    if (simplifier == RATE_DISTORTION_SIMPLIFIER)
+      return optimize(maximum_size, cancellation);
+
+    QuadTree::LeafSet leaves;
+    size_t nodes = 0;
+    for (const auto& root : roots) {
+      nodes += root->node_count();
+      if (root->type == QuadTree::SPLIT_TREE)
+        root->get_leaves(leaves);
+    }
+
+    // Every merge frees at least four nodes, and refusals only last until
+    // maximum_detail_loss reaches 3, at which point no merge is refused.
+    // Important nodes turn down all but 1 in importance() merges, and no
+    // node is more important than the edges and weights of the leaves can
+    // make it.
+    double edge_factor = 1;
+    double weight_factor = 1;
+    for (size_t i = 0; i < leaves.size(); ++i) {
+      edge_factor = max(edge_factor, leaves[i]->edge_factor());
+      weight_factor = max(weight_factor, leaves[i]->weight_factor());
+    }
+    const size_t maximum_attempts
+      = (8 * nodes + 64) * size_t(ceil(edge_factor * weight_factor));
+    size_t attempts = 0;
+    size_t refusals = 0;
+    size_t maximum_detail_loss = 0;
+    size_t current_size = encoded_size();
+
+    // A batch that overshoots the budget is undone and replayed with at
+    // most half as many merges. The same draws from the same tree make the
+    // replay a prefix of it, so merging stops at the first merge in the
+    // order that fits.
+    size_t merge_limit = SIZE_MAX;
+
+    while (!leaves.empty() && current_size > maximum_size) {
+
+      // Measuring the range-coded size means coding the whole forest, so
+      // merge about half of the estimated excess in nodes between
+      // measurements.
+      const size_t excess
+        = (current_size - maximum_size) * nodes / current_size / 2;
+      const size_t target = nodes - min(nodes, excess);
+      const size_t batch_nodes = nodes;
+      const size_t batch_attempts = attempts;
+      const size_t batch_refusals = refusals;
+      const size_t batch_detail_loss = maximum_detail_loss;
+      const mt19937 batch_random = random;
+      const auto snapshot(excess && merge_limit > 1 ? clone() : nullptr);
+      size_t merges = 0;
+
+      while (!leaves.empty()
+        && (!merges || (nodes > target && merges < merge_limit))) {
+
+        if (++attempts > maximum_attempts)
+          throw runtime_error
+            ("image is hopelessly complex; try a larger cell size");
+        if (cancellation && attempts % 1024 == 0
+          && cancellation->is_cancelled())
+          return false;
+
+        QuadTree* const leaf = leaves
+          [uniform_int_distribution<size_t>(0, leaves.size() - 1)(random)];
+        const double importance = leaf->parent->importance();
+        if (importance > 1
+          && uniform_real_distribution<double>(0, importance)(random) >= 1)
+          continue;
+        const size_t freed = QuadTree::merge_with_sibblings
+          (leaf, maximum_detail_loss, leaves);
+        if (!freed) {
+          if (++refusals > leaves.size()) {
+            ++maximum_detail_loss;
+            refusals = 0;
+          }
+          continue;
+        }
+
+        nodes -= freed;
+        ++merges;
+        refusals = 0;
 
-  cerr << "Needlessly building matrix\n";
-  Matrix<uint8_t> pixels(image.get_width(), image.get_height());
-  for (size_t y = 0; y < image.get_height(); ++y)
-    for (size_t x = 0; x < image.get_width(); ++x)
-      pixels(x, y) = image.get_pixel(x, y).value;
+      }
 
-  cerr << "Making matrix square\n";
-  auto square(make_square(pixels));
+      const size_t size = encoded_size();
+      if (size <= maximum_size && merges > 1) {
+        roots.swap(snapshot->roots);
+        random = batch_random;
+        merge_limit = merges / 2;
+        nodes = batch_nodes;
+        attempts = batch_attempts;
+        refusals = batch_refusals;
+        maximum_detail_loss = batch_detail_loss;
+        leaves = QuadTree::LeafSet();
+        for (const auto& root : roots)
+          if (root->type == QuadTree::SPLIT_TREE)
+            leaves.restore(root.get());
+        continue;
+      }
+      current_size = size;
 
-  cerr << "Building quadtree\n";
-  QuadTree tree(square);
+    }
 
-  cerr << "Merging leaves\n";
-  tree.merge_leaves();
+    if (current_size > maximum_size)
+      throw runtime_error
+        ("budget is below the smallest encoding; try a larger cell size");
+    return true;
+
+  }
+
+  // Prunes the forest to the point of its rate-distortion curve with the
+  // least distortion whose encoding fits in maximum_size bits. The curves of
+  // the roots, computed in parallel, are combined into the curve of the
+  // forest. Rates on the curve are those of the plain format; in the others
+  // the point is found by bisection over the curve, encoding pruned copies.
+  // Returns false, leaving the tree as it was, if cancelled, and throws if
+  // even the roots alone do not fit.
+  bool optimize(
+    const size_t maximum_size,
+    const Cancellation* const cancellation = nullptr
+  ) {
+
+    vector<QuadTree::RateCurve> curves(roots.size());
+    for_each_root([&](const size_t i, const size_t threads) {
+      curves[i] = roots[i]->rate_curve(threads);
+    });
+    const auto curve(QuadTree::combine(curves.data(), curves.size()));
+
+    size_t low = 0;
+    size_t high = curve.size() - 1;
+    if (QuadTree::format == QuadTree::PLAIN_FORMAT) {
+      while (low < high && header_size + curve[low + 1].rate <= maximum_size)
+        ++low;
+    } else {
+      while (low < high) {
+        if (cancellation && cancellation->is_cancelled())
+          return false;
+        const size_t middle = high - (high - low) / 2;
+        const auto copy(clone());
+        copy->prune(multiplier(curve, middle));
+        if (copy->encoded_size() <= maximum_size)
+          low = middle;
+        else
+          high = middle - 1;
+      }
+    }
+    prune(multiplier(curve, low));
+    if (low == 0 && encoded_size() > maximum_size)
+      throw runtime_error
+        ("budget is below the smallest encoding; try a larger cell size");
+    return true;
+
+  }
+
+private:
+
+  Forest(const size_t columns, const size_t rows)
+    : columns(columns), rows(rows),
+      threads(max<size_t>(1, thread::hardware_concurrency())) {}
+
+  // A multiplier for rate at which pruning stops at a point of the curve:
+  // one between the slopes of the segments on either side of it.
+  static long double multiplier(
+    const QuadTree::RateCurve& curve,
+    const size_t index
+  ) {
+    const auto slope = [&](const size_t i) {
+      return static_cast<long double>
+        (curve[i - 1].distortion - curve[i].distortion)
+        / (curve[i].rate - curve[i - 1].rate);
+    };
+    if (curve.size() == 1)
+      return 1;
+    if (index == 0)
+      return 2 * slope(1) + 1;
+    if (index + 1 == curve.size())
+      return slope(index) / 2;
+    return (slope(index) + slope(index + 1)) / 2;
+  }
+
+  void prune(const long double lambda) {
+    for_each_root([&](const size_t i, const size_t threads) {
+      roots[i]->prune(lambda, threads);
+    });
+  }
+
+  // Runs body(root index, threads) for every root, spreading the roots and
+  // then their subtrees over the forest's threads.
+  template<class F>
+  void for_each_root(const F& body) const {
+    const size_t share = max<size_t>(1, threads / roots.size());
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (size_t t = 0; t < min(threads, roots.size()); ++t) {
+      workers.emplace_back([&]() {
+        for (size_t i = next++; i < roots.size(); i = next++)
+          body(i, share);
+      });
+    }
+    for (auto& worker : workers)
+      worker.join();
+  }
+
+  Forest(const Forest&) = delete;
+  Forest& operator=(const Forest&) = delete;
+
+  // Writes the nodes of all the roots breadth-first, so that any prefix
+  // decodes to a coarser image. Each node is a split flag and its colour:
+  // "0" if it is the colour the decoder already shows for it, which is its
+  // parent's, or grey for a root; otherwise "1" and which of the other two
+  // colours it is. A split node's colour is the mean of its leaves.
+  void encode_progressive(ostream& stream) const {
+    struct Entry {
+      const QuadTree* node;
+      QuadTree::Type expected;
+      QuadTree::Type fill;
+    };
+    vector<Entry> queue;
+    for (const auto& root : roots) {
+      const Entry entry = {
+        root.get(), QuadTree::GREY_TREE, QuadTree::BLACK_TREE,
+      };
+      queue.push_back(entry);
+    }
+    for (size_t i = 0; i < queue.size(); ++i) {
+      const Entry entry = queue[i];
+      const QuadTree& node = *entry.node;
+      const bool split = node.type == QuadTree::SPLIT_TREE;
+      QuadTree::Type colour = split ? node.mean_type() : node.type;
+      if (colour == QuadTree::CLEAR_TREE)
+        colour = entry.fill;
+      stream << (split ? '1' : '0');
+      if (colour == entry.expected)
+        stream << '0';
+      else
+        stream << '1' << (colour == lower_colour(entry.expected) ? '0' : '1');
+      if (split) {
+        const QuadTree::Type fill = node.fill_type();
+        for (const auto& child : node.children) {
+          const Entry next = { child.get(), colour, fill };
+          queue.push_back(next);
+        }
+      }
+    }
+  }
+
+  // Reads as many nodes as there are, leaving the rest the colour of their
+  // parents.
+  void decode_progressive(istream& stream, const size_t maximum_nodes) {
+    vector<QuadTree*> queue;
+    vector<size_t> depths;
+    for (const auto& root : roots) {
+      root->type = QuadTree::GREY_TREE;
+      queue.push_back(root.get());
+      depths.push_back(0);
+    }
+    for (size_t i = 0; i < queue.size(); ++i) {
+      QuadTree* const node = queue[i];
+      char split, changed, which;
+      if (!stream.get(split) || !stream.get(changed))
+        break;
+      if (changed == '1') {
+        if (!stream.get(which))
+          break;
+        node->type = which == '1'
+          ? higher_colour(node->type) : lower_colour(node->type);
+      }
+      if (split == '1') {
+        if (depths[i] == QuadTree::maximum_depth
+          || queue.size() + 4 > maximum_nodes)
+          throw runtime_error("encoding describes too large a tree");
+        const QuadTree::Type colour = node->type;
+        node->type = QuadTree::SPLIT_TREE;
+        for (auto& child : node->children) {
+          child.reset(new QuadTree(node));
+          child->type = colour;
+          queue.push_back(child.get());
+          depths.push_back(depths[i] + 1);
+        }
+      }
+    }
+    merge_leaves();
+  }
+
+  // Preorder like the plain format, but a split node identical to one
+  // written out in full before may instead refer back to it. Leaves are
+  // written as in the plain format, a split as "110" followed by its
+  // children, and a reference as "111" and the index of the subtree among
+  // all those written out in full so far, in as few bits as can hold every
+  // index. A reference is used only where it is shorter than the subtree
+  // would be in the plain format.
+  void encode_dag(ostream& stream) const {
+    Dag dag;
+    for (const auto& root : roots)
+      identify(*root, QuadTree::BLACK_TREE, dag);
+    size_t index = 0;
+    size_t written = 0;
+    map<size_t, size_t> table;
+    while (index < dag.preorder.size())
+      write_dag(dag, index, written, table, stream);
+  }
+
+  // Identical subtrees, after CLEAR_TREE leaves are resolved, get the same
+  // identifier. Leaves are identified by their type, and split nodes by the
+  // identifiers of their children.
+  struct Dag {
+
+    Dag() : sizes(3, 1) {}
+
+    map<array<size_t, 4>, size_t> splits;
+    vector<size_t> sizes;
+    vector<size_t> preorder;
+
+  };
+
+  static size_t identify(
+    const QuadTree& node,
+    const QuadTree::Type fill,
+    Dag& dag
+  ) {
+    const size_t slot = dag.preorder.size();
+    dag.preorder.push_back(0);
+    size_t result = node.type == QuadTree::CLEAR_TREE ? fill : node.type;
+    if (node.type == QuadTree::SPLIT_TREE) {
+      const QuadTree::Type child_fill = node.fill_type();
+      array<size_t, 4> key;
+      size_t size = 1;
+      for (size_t i = 0; i < 4; ++i) {
+        key[i] = identify(*node.children[i], child_fill, dag);
+        size += dag.sizes[key[i]];
+      }
+      const auto inserted
+        = dag.splits.insert(make_pair(key, dag.sizes.size()));
+      result = inserted.first->second;
+      if (inserted.second)
+        dag.sizes.push_back(size);
+    }
+    dag.preorder[slot] = result;
+    return result;
+  }
+
+  static void write_dag(
+    const Dag& dag,
+    size_t& index,
+    size_t& written,
+    map<size_t, size_t>& table,
+    ostream& stream
+  ) {
+    const size_t id = dag.preorder[index];
+    if (id < QuadTree::SPLIT_TREE) {
+      stream << bitset<2>(id);
+      ++index;
+      return;
+    }
+    const auto found = table.find(id);
+    const size_t width = QuadTree::index_width(written);
+    if (found != table.end() && 3 + width < 2 * dag.sizes[id]) {
+      stream << "111";
+      for (size_t bit = width; bit--;)
+        stream << (found->second >> bit & 1 ? '1' : '0');
+      index += dag.sizes[id];
+      return;
+    }
+    stream << "110";
+    ++index;
+    for (size_t i = 0; i < 4; ++i)
+      write_dag(dag, index, written, table, stream);
+    table.insert(make_pair(id, written));
+    ++written;
+  }
+
+  // The lesser and greater of the two colours other than a given one.
+  static QuadTree::Type lower_colour(const QuadTree::Type colour) {
+    return colour == QuadTree::BLACK_TREE
+      ? QuadTree::GREY_TREE : QuadTree::BLACK_TREE;
+  }
+
+  static QuadTree::Type higher_colour(const QuadTree::Type colour) {
+    return colour == QuadTree::WHITE_TREE
+      ? QuadTree::GREY_TREE : QuadTree::WHITE_TREE;
+  }
+
+  // Picks the root size covering the image with the least area, using at
+  // most maximum_roots roots along each axis.
+  static size_t root_size(
+    const size_t width,
+    const size_t height,
+    const size_t cell_size
+  ) {
+    size_t best = next_greater_power_of_2(max(width, height));
+    size_t best_area = best * best;
+    for (size_t size = best / 2;
+      size && size >= cell_size;
+      size /= 2) {
+      const size_t columns = (width + size - 1) / size;
+      const size_t rows = (height + size - 1) / size;
+      if (columns > maximum_roots || rows > maximum_roots)
+        break;
+      if (columns * rows * size * size < best_area) {
+        best = size;
+        best_area = columns * rows * size * size;
+      }
+    }
+    return best;
+  }
+
+  friend ostream& operator<<(ostream& stream, const Forest& forest) {
+    for (size_t row = 0; row < forest.rows; ++row) {
+      for (size_t column = 0; column < forest.columns; ++column)
+        stream << *forest.roots[row * forest.columns + column];
+      if (row + 1 < forest.rows)
+        stream << '\n';
+    }
+    return stream;
+  }
+
+  struct TreeHeader {
+    char magic[8];
+    uint32_t version;
+    uint8_t columns;
+    uint8_t rows;
+    uint8_t low;
+    uint8_t high;
+    uint64_t nodes;
+  };
+
+  static const size_t header_size = 25;
+  static const size_t maximum_roots = 8;
+  static const char tree_magic[8];
+  static const uint32_t tree_version = 3;
+
+  size_t columns;
+  size_t rows;
+  vector<unique_ptr<QuadTree>> roots;
+  mt19937 random;
+  size_t threads;
+
+};
+
+const char Forest::tree_magic[8] = {'t', 'w', 'i', 't', 'p', 'n', 'g', 'Q'};
+
+Thresholds QuadTree::thresholds;
+QuadTree::Format QuadTree::format = QuadTree::PLAIN_FORMAT;
+double QuadTree::edge_weight = 0;
+uint64_t QuadTree::smooth_variation = 0;
+Forest::Simplifier Forest::simplifier = Forest::RANDOM_SIMPLIFIER;
+
+struct Quality {
+  double mse;
+  double psnr;
+  double ssim;
+};
+
+// Kernels for measure_quality(). Both work on rows of 4x4 blocks, holding
+// for each block the sums of the source samples x, the reconstructed
+// samples y, x², y² and xy, each sum in its own row of count values.
+class QualityKernels {
+public:
+
+  // Sums the blocks of a band of four rows.
+  static void block_sums(
+    const uint8_t* const x[4],
+    const uint8_t* const y[4],
+    const size_t count,
+    uint32_t* const sums[5]
+  ) {
+    size_t block = 0;
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2"))
+      block = block_sums_avx2(x, y, count, sums);
+#endif
+    for (; block < count; ++block) {
+      uint32_t totals[5] = {0, 0, 0, 0, 0};
+      for (size_t row = 0; row < 4; ++row) {
+        for (size_t i = block * 4; i < block * 4 + 4; ++i) {
+          const uint32_t a = x[row][i];
+          const uint32_t b = y[row][i];
+          totals[0] += a;
+          totals[1] += b;
+          totals[2] += a * a;
+          totals[3] += b * b;
+          totals[4] += a * b;
+        }
+      }
+      for (size_t k = 0; k < 5; ++k)
+        sums[k][block] = totals[k];
+    }
+  }
+
+  // Adds up the SSIM of the count - 1 windows of 2x2 blocks whose top
+  // halves are in above and bottom halves in below. With 64 samples to a
+  // window, every term before the division fits in 32 bits exactly.
+  static double window_ssim(
+    const uint32_t* const above[5],
+    const uint32_t* const below[5],
+    const size_t count
+  ) {
+    double result = 0;
+    size_t window = 0;
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2"))
+      window = window_ssim_avx2(above, below, count, result);
+#endif
+    for (; window + 1 < count; ++window) {
+      int64_t sums[5];
+      for (size_t k = 0; k < 5; ++k)
+        sums[k] = int64_t(above[k][window]) + above[k][window + 1]
+          + below[k][window] + below[k][window + 1];
+      const int64_t product = sums[0] * sums[1];
+      const int64_t squares = sums[0] * sums[0] + sums[1] * sums[1];
+      const int64_t covariance = 2 * (64 * sums[4] - product);
+      const int64_t variance = 64 * (sums[2] + sums[3]) - squares;
+      result += (2 * product + c1) * (covariance + c2)
+        / ((squares + c1) * (variance + c2));
+    }
+    return result;
+  }
+
+private:
+
+  // (0.01 * 255)² and (0.03 * 255)², scaled by the square of the window
+  // size.
+  static constexpr double c1 = 26634.24;
+  static constexpr double c2 = 239708.16;
+
+#ifdef __x86_64__
+  // Eight blocks at a time. Widened pixel pairs are multiplied and added
+  // into pairs of 32-bit sums, then pairs of pairs are added horizontally,
+  // which leaves the blocks in the order 0, 1, 4, 5, 2, 3, 6, 7.
+  __attribute__((target("avx2")))
+  static size_t block_sums_avx2(
+    const uint8_t* const x[4],
+    const uint8_t* const y[4],
+    const size_t count,
+    uint32_t* const sums[5]
+  ) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    size_t block = 0;
+    for (; block + 8 <= count; block += 8) {
+      __m256i sum_x = _mm256_setzero_si256();
+      __m256i sum_y = _mm256_setzero_si256();
+      __m256i sum_xx = _mm256_setzero_si256();
+      __m256i sum_yy = _mm256_setzero_si256();
+      __m256i sum_xy = _mm256_setzero_si256();
+      for (size_t row = 0; row < 4; ++row) {
+        const __m256i a0 = load16(x[row] + block * 4);
+        const __m256i a1 = load16(x[row] + block * 4 + 16);
+        const __m256i b0 = load16(y[row] + block * 4);
+        const __m256i b1 = load16(y[row] + block * 4 + 16);
+        sum_x = _mm256_add_epi32(sum_x, _mm256_hadd_epi32
+          (_mm256_madd_epi16(a0, ones), _mm256_madd_epi16(a1, ones)));
+        sum_y = _mm256_add_epi32(sum_y, _mm256_hadd_epi32
+          (_mm256_madd_epi16(b0, ones), _mm256_madd_epi16(b1, ones)));
+        sum_xx = _mm256_add_epi32(sum_xx, _mm256_hadd_epi32
+          (_mm256_madd_epi16(a0, a0), _mm256_madd_epi16(a1, a1)));
+        sum_yy = _mm256_add_epi32(sum_yy, _mm256_hadd_epi32
+          (_mm256_madd_epi16(b0, b0), _mm256_madd_epi16(b1, b1)));
+        sum_xy = _mm256_add_epi32(sum_xy, _mm256_hadd_epi32
+          (_mm256_madd_epi16(a0, b0), _mm256_madd_epi16(a1, b1)));
+      }
+      store8(sums[0] + block, sum_x, order);
+      store8(sums[1] + block, sum_y, order);
+      store8(sums[2] + block, sum_xx, order);
+      store8(sums[3] + block, sum_yy, order);
+      store8(sums[4] + block, sum_xy, order);
+    }
+    return block;
+  }
+
+  // Eight windows at a time, in exact integers up to the division, which is
+  // done in single precision.
+  __attribute__((target("avx2")))
+  static size_t window_ssim_avx2(
+    const uint32_t* const above[5],
+    const uint32_t* const below[5],
+    const size_t count,
+    double& result
+  ) {
+    const __m256 constant1 = _mm256_set1_ps(c1);
+    const __m256 constant2 = _mm256_set1_ps(c2);
+    __m256 total = _mm256_setzero_ps();
+    size_t window = 0;
+    for (; window + 9 <= count; window += 8) {
+      __m256i sums[5];
+      for (size_t k = 0; k < 5; ++k)
+        sums[k] = _mm256_add_epi32(
+          _mm256_add_epi32(load8(above[k] + window),
+            load8(above[k] + window + 1)),
+          _mm256_add_epi32(load8(below[k] + window),
+            load8(below[k] + window + 1)));
+      const __m256i product = _mm256_mullo_epi32(sums[0], sums[1]);
+      const __m256i squares = _mm256_add_epi32(
+        _mm256_mullo_epi32(sums[0], sums[0]),
+        _mm256_mullo_epi32(sums[1], sums[1]));
+      const __m256i covariance = _mm256_slli_epi32(_mm256_sub_epi32
+        (_mm256_slli_epi32(sums[4], 6), product), 1);
+      const __m256i variance = _mm256_sub_epi32(_mm256_slli_epi32
+        (_mm256_add_epi32(sums[2], sums[3]), 6), squares);
+      const __m256 numerator = _mm256_mul_ps(
+        _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_slli_epi32(product, 1)),
+          constant1),
+        _mm256_add_ps(_mm256_cvtepi32_ps(covariance), constant2));
+      const __m256 denominator = _mm256_mul_ps(
+        _mm256_add_ps(_mm256_cvtepi32_ps(squares), constant1),
+        _mm256_add_ps(_mm256_cvtepi32_ps(variance), constant2));
+      total = _mm256_add_ps(total, _mm256_div_ps(numerator, denominator));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, total);
+    for (const float lane : lanes)
+      result += lane;
+    return window;
+  }
+
+  __attribute__((target("avx2")))
+  static __m256i load16(const uint8_t* const bytes) {
+    return _mm256_cvtepu8_epi16
+      (_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes)));
+  }
+
+  __attribute__((target("avx2")))
+  static __m256i load8(const uint32_t* const values) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values));
+  }
+
+  __attribute__((target("avx2")))
+  static void store8(uint32_t* const output, const __m256i lanes,
+    const __m256i order) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output),
+      _mm256_permutevar8x32_epi32(lanes, order));
+  }
+#endif
+
+};
+
+// Compares a reconstruction with its source. MSE and PSNR count only the
+// pixels that are opaque in mask, if it is not empty; masked pixels of the
+// reconstruction should equal the source. SSIM is the mean over 8x8 windows
+// on a 4-pixel grid, with uniform weights, and is NaN for images too small
+// to hold a window.
+Quality measure_quality(
+  const MatrixView<const uint8_t>& source,
+  const MatrixView<const uint8_t>& reconstruction,
+  const MatrixView<const uint8_t>& mask
+) {
+
+  const size_t width = source.get_width();
+  const size_t height = source.get_height();
+  if (reconstruction.get_width() != width
+    || reconstruction.get_height() != height)
+    throw runtime_error("measure_quality() on images of different sizes");
+
+  const size_t columns = width / 4;
+  const size_t rows = height / 4;
+  Matrix<uint32_t> sums(columns * 5, rows);
+  uint64_t error = 0;
+  double total = 0;
+  for (size_t row = 0; row < rows; ++row) {
+    const uint8_t* x[4];
+    const uint8_t* y[4];
+    for (size_t i = 0; i < 4; ++i) {
+      x[i] = source.row(row * 4 + i);
+      y[i] = reconstruction.row(row * 4 + i);
+    }
+    uint32_t* band[5];
+    for (size_t k = 0; k < 5; ++k)
+      band[k] = sums.row(row) + columns * k;
+    QualityKernels::block_sums(x, y, columns, band);
+    for (size_t i = 0; i < columns; ++i)
+      error += uint64_t(band[2][i]) + band[3][i] - 2 * uint64_t(band[4][i]);
+    if (row) {
+      const uint32_t* above[5];
+      for (size_t k = 0; k < 5; ++k)
+        above[k] = sums.row(row - 1) + columns * k;
+      total += QualityKernels::window_ssim(above, band, columns);
+    }
+  }
+
+  // Pixels outside the whole blocks.
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = y < rows * 4 ? columns * 4 : 0; x < width; ++x) {
+      const int difference = int(source(x, y)) - int(reconstruction(x, y));
+      error += difference * difference;
+    }
+  }
+
+  uint64_t pixels = uint64_t(width) * height;
+  if (mask.get_width()) {
+    pixels = 0;
+    for (size_t y = 0; y < height; ++y)
+      for (size_t x = 0; x < width; ++x)
+        pixels += mask(x, y) != 0;
+  }
+
+  Quality result;
+  result.mse = pixels ? double(error) / pixels : 0;
+  result.psnr = 10 * log10(255.0 * 255.0 / result.mse);
+  const size_t windows = rows > 1 && columns > 1
+    ? (rows - 1) * (columns - 1) : 0;
+  result.ssim = windows ? total / windows : NAN;
+
+  return result;
+
+}
+
+// Renders a forest over its source and measures it. Pixels that are masked
+// out are copied from the source, so only opaque pixels count.
+Quality measure_quality(
+  const Forest& forest,
+  const MatrixView<const uint8_t>& source,
+  const MatrixView<const uint8_t>& mask
+) {
+  auto reconstruction
+    (forest.render(source.get_width(), source.get_height()));
+  if (mask.get_width())
+    for (size_t y = 0; y < source.get_height(); ++y)
+      for (size_t x = 0; x < source.get_width(); ++x)
+        if (!mask(x, y))
+          reconstruction(x, y) = source(x, y);
+  return measure_quality(source, reconstruction, mask);
+}
+
+// A decoded image: grey levels, plus an opacity mask that is left empty
+// when the source has no alpha channel. Each pixel stands for a square of
+// decimation pixels on a side in the source.
+struct Image {
+
+  Image(
+    const size_t width,
+    const size_t height,
+    const bool has_alpha,
+    const size_t decimation
+  ) : pixels(width, height),
+      mask(has_alpha ? width : 0, has_alpha ? height : 0),
+      decimation(decimation) {}
+
+  explicit Image(Matrix<uint8_t>&& pixels)
+    : pixels(move(pixels)), decimation(1) {}
+
+  Matrix<uint8_t> pixels;
+  Matrix<uint8_t> mask;
+  size_t decimation;
+
+};
+
+class PngReader {
+public:
+
+  explicit PngReader(const string& filename)
+    : file(fopen(filename.c_str(), "rb"), &fclose) {
+    if (!file)
+      throw runtime_error("unable to open " + filename);
+    structs.png = png_create_read_struct
+      (PNG_LIBPNG_VER_STRING, this, &PngReader::error, &PngReader::warning);
+    if (structs.png)
+      structs.info = png_create_info_struct(structs.png);
+    if (!structs.info)
+      throw runtime_error("unable to initialize libpng");
+    png_init_io(structs.png, file.get());
+  }
+
+  png_structp png() const { return structs.png; }
+  png_infop info() const { return structs.info; }
+
+  // Makes calls into libpng. On error, libpng longjmps back here out of its
+  // own frames, and the error is thrown from C++ code. The calls must not
+  // construct objects with destructors, which the longjmp would skip.
+  template<class F>
+  void call(const F& calls) {
+    if (setjmp(png_jmpbuf(structs.png)))
+      throw runtime_error(message);
+    calls();
+  }
+
+private:
+
+  // Owns the read and info structures.
+  struct Structs {
+
+    Structs() : png(nullptr), info(nullptr) {}
+
+    ~Structs() {
+      if (png)
+        png_destroy_read_struct(&png, info ? &info : nullptr, nullptr);
+    }
+
+    png_structp png;
+    png_infop info;
+
+  };
+
+  PngReader(const PngReader&) = delete;
+  PngReader& operator=(const PngReader&) = delete;
+
+  // Keeps the message for call() and returns to it.
+  static void error(png_structp png, png_const_charp text) {
+    PngReader* const reader
+      = static_cast<PngReader*>(png_get_error_ptr(png));
+    strncpy(reader->message, text, sizeof reader->message - 1);
+    reader->message[sizeof reader->message - 1] = '\0';
+    png_longjmp(png, 1);
+  }
+
+  static void warning(png_structp, png_const_charp) {}
+
+  unique_ptr<FILE, int (*)(FILE*)> file;
+  Structs structs;
+  char message[256];
+
+};
+
+// Converts RGBA rows to grey. Channels are decoded from sRGB to 12-bit
+// linear light through a table, mixed with Rec. 709 weights, and re-encoded
+// to sRGB, so that thresholds apply to perceived rather than encoded
+// brightness. The AVX2 path produces exactly the same bytes as the scalar
+// one.
+class LumaConverter {
+public:
+
+  LumaConverter() {
+    for (size_t i = 0; i < 256; ++i) {
+      const double value = i / 255.0;
+      const double linear = value <= 0.04045
+        ? value / 12.92
+        : pow((value + 0.055) / 1.055, 2.4);
+      const int32_t value12 = int32_t(linear * 4095 + 0.5);
+      red_table[i] = value12 * 6966;
+      green_table[i] = value12 * 23436;
+      blue_table[i] = value12 * 2366 + (1 << 14);
+    }
+    for (size_t i = 0; i < 4096; ++i) {
+      const double linear = i / 4095.0;
+      const double value = linear <= 0.0031308
+        ? linear * 12.92
+        : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+      encode_table[i] = int32_t(value * 255 + 0.5);
+    }
+  }
+
+  // Writes width grey values from rgba into luma and, if mask is non-null,
+  // whether each pixel is opaque.
+  void convert(
+    const uint8_t* const rgba,
+    const size_t width,
+    uint8_t* const luma,
+    uint8_t* const mask
+  ) const {
+    size_t x = 0;
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2"))
+      x = convert_avx2(rgba, width, luma, mask);
+#endif
+    for (; x < width; ++x) {
+      const uint8_t* const pixel = rgba + x * 4;
+      luma[x] = encode_table[(red_table[pixel[0]]
+        + green_table[pixel[1]] + blue_table[pixel[2]]) >> 15];
+      if (mask)
+        mask[x] = pixel[3] != 0;
+    }
+  }
+
+private:
+
+#ifdef __x86_64__
+  __attribute__((target("avx2")))
+  size_t convert_avx2(
+    const uint8_t* const rgba,
+    const size_t width,
+    uint8_t* const luma,
+    uint8_t* const mask
+  ) const {
+    const __m256i bytes = _mm256_set1_epi32(0xff);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+      const __m256i pixels = _mm256_loadu_si256
+        (reinterpret_cast<const __m256i*>(rgba + x * 4));
+      const __m256i red = _mm256_i32gather_epi32
+        (red_table, _mm256_and_si256(pixels, bytes), 4);
+      const __m256i green = _mm256_i32gather_epi32(green_table,
+        _mm256_and_si256(_mm256_srli_epi32(pixels, 8), bytes), 4);
+      const __m256i blue = _mm256_i32gather_epi32(blue_table,
+        _mm256_and_si256(_mm256_srli_epi32(pixels, 16), bytes), 4);
+      const __m256i linear = _mm256_srli_epi32
+        (_mm256_add_epi32(_mm256_add_epi32(red, green), blue), 15);
+      const __m256i grey
+        = _mm256_i32gather_epi32(encode_table, linear, 4);
+      store8(luma + x, grey, zero);
+      if (mask) {
+        const __m256i opaque = _mm256_and_si256(one, _mm256_cmpgt_epi32
+          (_mm256_srli_epi32(pixels, 24), zero));
+        store8(mask + x, opaque, zero);
+      }
+    }
+    return x;
+  }
+
+  // Stores the low bytes of eight 32-bit lanes.
+  __attribute__((target("avx2")))
+  static void store8(uint8_t* const output, const __m256i lanes,
+    const __m256i zero) {
+    const __m256i packed
+      = _mm256_packus_epi16(_mm256_packus_epi32(lanes, zero), zero);
+    const uint32_t low = _mm256_extract_epi32(packed, 0);
+    const uint32_t high = _mm256_extract_epi32(packed, 4);
+    memcpy(output, &low, 4);
+    memcpy(output + 4, &high, 4);
+  }
+#endif
+
+  // Linear light scaled by the Rec. 709 weights in Q15; the rounding term
+  // is folded into the blue table.
+  int32_t red_table[256];
+  int32_t green_table[256];
+  int32_t blue_table[256];
+  int32_t encode_table[4096];
+
+};
+
+// Decodes straight into the destination matrices. libpng expands palettes
+// and low bit depths, strips 16-bit samples, normalizes files with a gAMA
+// chunk to sRGB, and pads colour to RGBA for LumaConverter.
+//
+// Only every decimation-th pixel in each direction is kept, decimation being
+// a power of two. Interlaced images are read pass by pass without libpng's
+// interlace handling, and reading stops after the last Adam7 pass that
+// contains any of the kept pixels: the first pass alone samples every eighth
+// pixel.
+//
+// With levels set the file must be greyscale and its stored levels are kept
+// as they are, without gamma correction.
+Image read_png(
+  const string& filename,
+  const size_t decimation,
+  const bool levels = false
+) {
+
+  PngReader reader(filename);
+  const auto png = reader.png();
+  const auto info = reader.info();
+  reader.call([&]() { png_read_info(png, info); });
+
+  const auto color_type = png_get_color_type(png, info);
+  const bool has_color = color_type & PNG_COLOR_MASK_COLOR;
+  const bool has_alpha = (color_type & PNG_COLOR_MASK_ALPHA)
+    || png_get_valid(png, info, PNG_INFO_tRNS);
+  if (levels && has_color)
+    throw runtime_error("PNG is not greyscale");
+  reader.call([&]() {
+    png_set_expand(png);
+    png_set_strip_16(png);
+    if (has_color && !has_alpha)
+      png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+    double gamma;
+    if (!levels && !png_get_valid(png, info, PNG_INFO_sRGB)
+      && png_get_gAMA(png, info, &gamma))
+      png_set_gamma(png, PNG_DEFAULT_sRGB, gamma);
+    png_read_update_info(png, info);
+  });
+
+  const size_t channels = has_color ? 4 : has_alpha ? 2 : 1;
+  if (png_get_channels(png, info) != channels)
+    throw runtime_error("unsupported PNG layout");
+
+  const size_t width = png_get_image_width(png, info);
+  const size_t height = png_get_image_height(png, info);
+  const bool interlaced
+    = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+  const int passes = !interlaced ? 1
+    : decimation >= 8 ? 1
+    : decimation == 4 ? 3
+    : decimation == 2 ? 5
+    : 7;
+  const bool direct = !interlaced && decimation == 1 && channels == 1;
+
+  Image image((width + decimation - 1) / decimation,
+    (height + decimation - 1) / decimation, has_alpha, decimation);
+  vector<uint8_t> buffer(width * channels);
+  vector<uint8_t> selected(width * channels);
+  vector<uint8_t> pixels(width);
+  vector<uint8_t> mask(width);
+  const LumaConverter converter;
+
+  for (int pass = 0; pass < passes; ++pass) {
+
+    const size_t columns
+      = interlaced ? PNG_PASS_COLS(width, pass) : width;
+    const size_t rows = interlaced ? PNG_PASS_ROWS(height, pass) : height;
+    if (!columns)
+      continue;
+    const size_t column_step
+      = interlaced ? size_t(1) << PNG_PASS_COL_SHIFT(pass) : 1;
+    const size_t spacing = max(column_step, decimation) / decimation;
+
+    for (size_t row = 0; row < rows; ++row) {
+
+      const size_t y = interlaced ? PNG_ROW_FROM_PASS_ROW(row, pass) : row;
+      uint8_t* const target = direct ? image.pixels.row(y) : buffer.data();
+      reader.call([&]() { png_read_row(png, target, nullptr); });
+      if (direct)
+        continue;
+
+      if (y % decimation)
+        continue;
+
+      size_t count = 0;
+      size_t first = 0;
+      for (size_t i = 0; i < columns; ++i) {
+        const size_t x = interlaced ? PNG_COL_FROM_PASS_COL(i, pass) : i;
+        if (x % decimation)
+          continue;
+        if (!count)
+          first = x / decimation;
+        copy_n(&buffer[i * channels], channels, &selected[count * channels]);
+        ++count;
+      }
+
+      if (channels == 4) {
+        converter.convert(selected.data(), count, pixels.data(),
+          has_alpha ? mask.data() : nullptr);
+      } else {
+        for (size_t i = 0; i < count; ++i) {
+          pixels[i] = selected[i * channels];
+          if (has_alpha)
+            mask[i] = selected[i * channels + 1] != 0;
+        }
+      }
+
+      for (size_t i = 0; i < count; ++i) {
+        image.pixels(first + i * spacing, y / decimation) = pixels[i];
+        if (has_alpha)
+          image.mask(first + i * spacing, y / decimation) = mask[i];
+      }
+
+    }
+
+  }
+
+  if (passes == (interlaced ? 7 : 1))
+    reader.call([&]() { png_read_end(png, nullptr); });
+  return image;
+
+}
+
+// Reads 8-bit binary PGM and PPM files. A PGM is mapped and used in place;
+// a PPM is decimated and converted to grey like a colour PNG.
+Image read_pnm(const string& filename, const size_t decimation) {
+
+  Mapping mapping(Mapping::file(filename));
+  const uint8_t* const bytes = mapping.get();
+  const size_t size = mapping.get_size();
+  if (size < 2 || bytes[0] != 'P' || (bytes[1] != '5' && bytes[1] != '6'))
+    throw runtime_error("not a binary PGM or PPM file");
+  const bool is_color = bytes[1] == '6';
+
+  // Larger than any dimension an image of a mappable size can have, and
+  // small enough that products of two fields cannot overflow.
+  const size_t maximum_field = size_t(1) << 30;
+  size_t offset = 2;
+  const auto field = [&]() {
+    for (;;) {
+      while (offset < size && isspace(bytes[offset]))
+        ++offset;
+      if (offset < size && bytes[offset] == '#') {
+        while (offset < size && bytes[offset] != '\n')
+          ++offset;
+        continue;
+      }
+      break;
+    }
+    if (offset == size || !isdigit(bytes[offset]))
+      throw runtime_error("invalid PNM header");
+    size_t result = 0;
+    while (offset < size && isdigit(bytes[offset])) {
+      result = result * 10 + (bytes[offset++] - '0');
+      if (result > maximum_field)
+        throw runtime_error("invalid PNM header");
+    }
+    return result;
+  };
+  const size_t width = field();
+  const size_t height = field();
+  if (!width || !height)
+    throw runtime_error("invalid PNM header");
+  if (field() != 255)
+    throw runtime_error("only 8-bit PNM files are supported");
+  if (offset == size || !isspace(bytes[offset]))
+    throw runtime_error("invalid PNM header");
+  ++offset;
+
+  if (!is_color)
+    return Image(Matrix<uint8_t>(move(mapping), offset, width, height));
+
+  if (width > (size - offset) / height / 3)
+    throw runtime_error("file too short for image");
+  Image image((width + decimation - 1) / decimation,
+    (height + decimation - 1) / decimation, false, decimation);
+  vector<uint8_t> rgba(image.pixels.get_width() * 4, 0xff);
+  const LumaConverter converter;
+  for (size_t y = 0; y < image.pixels.get_height(); ++y) {
+    const uint8_t* const row = bytes + offset + y * decimation * width * 3;
+    for (size_t x = 0; x < image.pixels.get_width(); ++x)
+      copy_n(row + x * decimation * 3, 3, &rgba[x * 4]);
+    converter.convert(rgba.data(), image.pixels.get_width(),
+      image.pixels.row(y), nullptr);
+  }
+  return image;
+
+}
+
+// Maps headerless 8-bit grey data of known dimensions.
+Image read_raw(const string& filename, const size_t width, const size_t height) {
+  Mapping mapping(Mapping::file(filename));
+  if (mapping.get_size() % width || mapping.get_size() / width != height)
+    throw runtime_error("raw file size does not match dimensions");
+  return Image(Matrix<uint8_t>(move(mapping), 0, width, height));
+}
+
+// A rectangle of an image, in pixels, and the weight of its pixels, at most
+// 255/16.
+struct WeightedRegion {
+  size_t x;
+  size_t y;
+  size_t width;
+  size_t height;
+  double weight;
+};
+
+// The weights of the pixels of an image of the given size, in sixteenths,
+// sampled like it at one pixel in decimation. They come from a greyscale
+// PNG map of the same size as the image, in which stored level 16 stands
+// for a weight of 1, or are 1 without one, and regions are painted over
+// them.
+Matrix<uint8_t> read_weights(
+  const string& filename,
+  const vector<WeightedRegion>& regions,
+  const size_t width,
+  const size_t height,
+  const size_t decimation
+) {
+  Matrix<uint8_t> result(width, height);
+  if (filename.empty()) {
+    for (size_t y = 0; y < height; ++y)
+      memset(result.row(y), 16, width);
+  } else {
+    const Image map(read_png(filename, decimation, true));
+    if (map.pixels.get_width() != width || map.pixels.get_height() != height)
+      throw runtime_error("weight map size does not match image");
+    for (size_t y = 0; y < height; ++y)
+      memcpy(result.row(y), map.pixels.row(y), width);
+  }
+  for (const auto& region : regions) {
+    const uint8_t value = uint8_t(region.weight * 16 + 0.5);
+    const size_t left = min(width, region.x / decimation);
+    const size_t right = (min(width * decimation, region.x + region.width)
+      + decimation - 1) / decimation;
+    const size_t top = min(height, region.y / decimation);
+    const size_t bottom = (min(height * decimation, region.y + region.height)
+      + decimation - 1) / decimation;
+    for (size_t y = top; y < bottom && left < right; ++y)
+      memset(result.row(y) + left, value, right - left);
+  }
+  return result;
+}
+
+// XXH64.
+uint64_t hash_bytes(const uint8_t* data, const size_t size, const uint64_t seed) {
+
+  const uint64_t prime1 = 11400714785074694791ULL;
+  const uint64_t prime2 = 14029467366897019727ULL;
+  const uint64_t prime3 = 1609587929392839161ULL;
+  const uint64_t prime4 = 9650029242287828579ULL;
+  const uint64_t prime5 = 2870177450012600261ULL;
+
+  const auto rotate = [](const uint64_t value, const int bits) {
+    return value << bits | value >> (64 - bits);
+  };
+  const auto read64 = [](const uint8_t* const bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, 8);
+    return value;
+  };
+  const auto round = [&](const uint64_t accumulator, const uint64_t input) {
+    return rotate(accumulator + input * prime2, 31) * prime1;
+  };
+  const auto merge = [&](const uint64_t accumulator, const uint64_t value) {
+    return (accumulator ^ round(0, value)) * prime1 + prime4;
+  };
+
+  const uint8_t* const end = data + size;
+  uint64_t result;
+  if (size >= 32) {
+    uint64_t lanes[4] = {
+      seed + prime1 + prime2, seed + prime2, seed, seed - prime1,
+    };
+    for (; data + 32 <= end; data += 32)
+      for (size_t i = 0; i < 4; ++i)
+        lanes[i] = round(lanes[i], read64(data + i * 8));
+    result = rotate(lanes[0], 1) + rotate(lanes[1], 7)
+      + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+    for (size_t i = 0; i < 4; ++i)
+      result = merge(result, lanes[i]);
+  } else {
+    result = seed + prime5;
+  }
+  result += size;
+
+  for (; data + 8 <= end; data += 8)
+    result = rotate(result ^ round(0, read64(data)), 27) * prime1 + prime4;
+  if (data + 4 <= end) {
+    uint32_t value;
+    memcpy(&value, data, 4);
+    result = rotate(result ^ (value * prime1), 23) * prime2 + prime3;
+    data += 4;
+  }
+  for (; data < end; ++data)
+    result = rotate(result ^ (*data * prime5), 11) * prime1;
+
+  result ^= result >> 33;
+  result *= prime2;
+  result ^= result >> 29;
+  result *= prime3;
+  result ^= result >> 32;
+  return result;
+
+}
+
+uint64_t hash_matrix(const MatrixView<const uint8_t>& matrix, uint64_t seed) {
+  const size_t width = matrix.get_width();
+  const size_t height = matrix.get_height();
+  const uint64_t dimensions[] = { width, height };
+  seed = hash_bytes(reinterpret_cast<const uint8_t*>(dimensions),
+    sizeof dimensions, seed);
+  if (matrix.get_stride() == width)
+    return hash_bytes(matrix.row(0), width * height, seed);
+  for (size_t y = 0; y < height; ++y)
+    seed = hash_bytes(matrix.row(y), width, seed);
+  return seed;
+}
+
+// A fixed-size, open-addressed table of encodings in a shared file, keyed by
+// a hash of the image and a hash of the options that produced it. Readers
+// take a shared lock and writers an exclusive one, so any number of
+// processes may use one cache at once.
+class Cache {
+public:
+
+  explicit Cache(const string& filename)
+    : file(open(filename.c_str(), O_RDWR | O_CREAT, 0644)) {
+    if (file == -1)
+      throw runtime_error("unable to open cache " + filename);
+    Lock lock(file, LOCK_EX);
+    const off_t size = lseek(file, 0, SEEK_END);
+    if (size == 0) {
+      if (ftruncate(file, file_size) != 0) {
+        close(file);
+        throw runtime_error("unable to initialize cache " + filename);
+      }
+    } else if (size != off_t(file_size)) {
+      close(file);
+      throw runtime_error("invalid cache file " + filename);
+    }
+    void* address
+      = mmap(0, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (address == MAP_FAILED) {
+      close(file);
+      throw runtime_error("unable to map cache " + filename);
+    }
+    slots = static_cast<Slot*>(address);
+  }
+
+  ~Cache() {
+    munmap(slots, file_size);
+    close(file);
+  }
+
+  bool find(const uint64_t key, const uint64_t options, string& value) const {
+    Lock lock(file, LOCK_SH);
+    for (size_t probe = 0; probe < probes; ++probe) {
+      const Slot& slot = slots[index(key, options, probe)];
+      if (slot.key == key && slot.options == options && slot.size
+        && slot.size <= sizeof(Slot::value)
+        && slot.check == checksum(slot)) {
+        value.assign(slot.value, slot.size);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void insert(const uint64_t key, const uint64_t options, const string& value) {
+    if (value.empty() || value.size() > sizeof(Slot::value))
+      return;
+    Lock lock(file, LOCK_EX);
+    Slot* target = &slots[index(key, options, 0)];
+    for (size_t probe = 0; probe < probes; ++probe) {
+      Slot& slot = slots[index(key, options, probe)];
+      if (!slot.size || (slot.key == key && slot.options == options)) {
+        target = &slot;
+        break;
+      }
+    }
+    // The slot is published last, so that a writer killed part way
+    // leaves it empty or failing its checksum rather than serving a
+    // partial value.
+    target->size = 0;
+    atomic_thread_fence(memory_order_seq_cst);
+    copy(value.begin(), value.end(), target->value);
+    target->key = key;
+    target->options = options;
+    target->check = checksum(key, options, target->value, value.size());
+    atomic_thread_fence(memory_order_seq_cst);
+    target->size = value.size();
+  }
+
+private:
+
+  struct Slot {
+    uint64_t key;
+    uint64_t options;
+    uint64_t check;
+    uint32_t size;
+    char value[996];
+  };
+
+  static uint64_t checksum(
+    const uint64_t key,
+    const uint64_t options,
+    const char* const value,
+    const size_t size
+  ) {
+    return hash_bytes
+      (reinterpret_cast<const uint8_t*>(value), size, key ^ options);
+  }
+
+  static uint64_t checksum(const Slot& slot) {
+    return checksum(slot.key, slot.options, slot.value, slot.size);
+  }
+
+  class Lock {
+  public:
+    Lock(const int file, const int operation) : file(file) {
+      if (flock(file, operation) != 0)
+        throw runtime_error("unable to lock cache");
+    }
+    ~Lock() { flock(file, LOCK_UN); }
+  private:
+    int file;
+  };
+
+  Cache(const Cache&) = delete;
+  Cache& operator=(const Cache&) = delete;
+
+  static size_t index(
+    const uint64_t key,
+    const uint64_t options,
+    const size_t probe
+  ) {
+    return ((key ^ options) + probe) % slot_count;
+  }
+
+  static const size_t slot_count = 4096;
+  static const size_t probes = 8;
+  static const size_t file_size = slot_count * sizeof(Slot);
+
+  int file;
+  Slot* slots;
+
+};
+
+bool has_extension(const string& filename, const string& extension) {
+  return filename.size() > extension.size()
+    && equal(extension.rbegin(), extension.rend(), filename.rbegin(),
+      [](const char a, const char b) { return a == tolower(b); });
+}
+
+// Payload bits that fit in a number of output characters. For the ASCII
+// alphabet this keeps the original ratio of 903 bits per 140 characters.
+size_t budget_bits(const size_t characters, const bool unicode) {
+  return unicode ? characters * unicode_bits : characters * 903 / 140;
+}
+
+// Encodes the tree in the ASCII or Unicode alphabet.
+string encode_string(const Forest& tree, const bool unicode) {
+  if (!unicode)
+    return show_int(tree.encode());
+  const auto bits(tree.encode_bits());
+  const auto bytes(pack_bits(bits));
+  vector<char> buffer(unicode_size(bits.size()));
+  const size_t size
+    = show_unicode(bytes.data(), bits.size(), buffer.data(), buffer.size());
+  return string(buffer.data(), size);
+}
+
+size_t character_count(const string& encoding, const bool unicode) {
+  return unicode ? encoding.size() / 3 : encoding.size();
+}
+
+// Simplifies the tree to each budget in turn and returns the encodings in
+// the order of the budgets. Budgets are met from largest to smallest, each
+// simplifying the tree left by the one before, so one merge order serves
+// all of them.
+// Returns no encodings if cancelled.
+vector<string> encode_budgets(
+  Forest& tree,
+  const vector<size_t>& budgets,
+  const bool unicode,
+  uint64_t* const distortion = nullptr,
+  const Cancellation* const cancellation = nullptr
+) {
+  vector<size_t> order(budgets.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  stable_sort(begin(order), end(order), [&](size_t a, size_t b) {
+    return budgets[a] > budgets[b];
+  });
+  vector<string> outputs(budgets.size());
+
+  // Progressive encodings in the fixed-width Unicode alphabet serve every
+  // smaller budget by truncation.
+  if (unicode && QuadTree::format == QuadTree::PROGRESSIVE_FORMAT) {
+    const size_t largest = budgets[order[0]];
+    if (!tree.simplify(budget_bits(largest, unicode), cancellation))
+      return vector<string>();
+    if (distortion)
+      *distortion += tree.distortion();
+    const string encoding(encode_string(tree, unicode));
+    for (size_t i = 0; i < budgets.size(); ++i)
+      outputs[i] = encoding.substr(0, budgets[i] * 3);
+    return outputs;
+  }
+
+  for (const auto index : order) {
+    if (!tree.simplify(budget_bits(budgets[index], unicode), cancellation))
+      return vector<string>();
+    if (distortion)
+      *distortion += tree.distortion();
+    outputs[index] = encode_string(tree, unicode);
+  }
+  return outputs;
+}
+
+// Simplifies copies of the tree, each with its own seed, on the threads of
+// the tree, and returns the encodings of the run with the least distortion
+// summed over the budgets. Without a cancellation there are starts runs.
+// With one, runs continue until it is cancelled, except that run 0, whose
+// merges are bounded like every run's, always finishes, so that there is
+// always a result. The rate-distortion simplifier draws nothing, so it
+// makes only one run, which always finishes too.
+vector<string> encode_best(
+  Forest& tree,
+  const vector<size_t>& budgets,
+  const bool unicode,
+  const size_t starts,
+  const Cancellation* const cancellation = nullptr
+) {
+
+  if (Forest::simplifier == Forest::RATE_DISTORTION_SIMPLIFIER
+    || (starts <= 1 && !cancellation))
+    return encode_budgets(tree, budgets, unicode);
+
+  atomic<size_t> next_run(0);
+  mutex best_mutex;
+  size_t best_run = 0;
+  uint64_t best_distortion = UINT64_MAX;
+  vector<string> best;
+  exception_ptr failure;
+
+  const size_t thread_count = cancellation
+    ? tree.get_threads() : min(tree.get_threads(), starts);
+  vector<thread> threads;
+  for (size_t t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&]() {
+      try {
+        for (;;) {
+          const size_t run = next_run++;
+          if (cancellation
+            ? run && cancellation->is_cancelled() : run >= starts)
+            return;
+          const auto copy(tree.clone());
+          copy->seed(mt19937::default_seed + run);
+          copy->set_threads(tree.get_threads() / thread_count);
+          uint64_t distortion = 0;
+          auto outputs = encode_budgets(*copy, budgets, unicode,
+            &distortion, run ? cancellation : nullptr);
+          if (outputs.empty())
+            return;
+          lock_guard<mutex> lock(best_mutex);
+          if (best.empty() || distortion < best_distortion
+            || (distortion == best_distortion && run < best_run)) {
+            best_run = run;
+            best_distortion = distortion;
+            best = move(outputs);
+          }
+        }
+      } catch (...) {
+        lock_guard<mutex> lock(best_mutex);
+        if (!failure)
+          failure = current_exception();
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  if (failure)
+    rethrow_exception(failure);
+
+  return best;
+
+}
+
+// Minimum quality for an encoding; zero means no requirement.
+struct QualityTarget {
+
+  QualityTarget() : psnr(0), ssim(0) {}
+
+  bool is_set() const {
+    return psnr || ssim;
+  }
+
+  bool is_met(const Quality& quality) const {
+    return quality.psnr >= psnr && (!ssim || quality.ssim >= ssim);
+  }
+
+  double psnr;
+  double ssim;
+
+};
+
+// Finds the shortest encoding of the tree that meets the target, by
+// bisection over the budget in characters. Every probe simplifies a fresh
+// copy with the same seed, and the merges simplify() draws do not depend on
+// the size it stops at, so all probes prune along one merge order and
+// quality only falls with the budget. If cancelled, the search stops with
+// the shortest encoding found so far that meets the target.
+string encode_target(
+  const Forest& tree,
+  const Image& image,
+  const bool unicode,
+  const QualityTarget& target,
+  size_t& characters,
+  const Cancellation* const cancellation = nullptr
+) {
+
+  string best(encode_string(tree, unicode));
+  if (!target.is_met(measure_quality(tree, image.pixels, image.mask)))
+    throw runtime_error
+      ("quality target is out of reach; try a smaller cell size");
+
+  size_t low = 1;
+  size_t high = character_count(best, unicode);
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    const auto copy(tree.clone());
+    bool met;
+    try {
+      if (!copy->simplify(budget_bits(middle, unicode), cancellation))
+        break;
+      met = target.is_met(measure_quality(*copy, image.pixels, image.mask));
+    } catch (const runtime_error&) {
+      met = false;
+    }
+    if (met) {
+      best = encode_string(*copy, unicode);
+      high = min(middle, character_count(best, unicode));
+    } else {
+      low = middle + 1;
+    }
+  }
+  characters = character_count(best, unicode);
+  return best;
+
+}
+
+// Squared error of the images drawn from the encodings against the source,
+// summed, each pixel's weighted by the weight map if there is one.
+// Transparent pixels do not count.
+uint64_t encoding_error(
+  const vector<string>& encodings,
+  const Image& image,
+  const MatrixView<const uint8_t>& weights,
+  const bool unicode
+) {
+  const size_t width = image.pixels.get_width();
+  const size_t height = image.pixels.get_height();
+  uint64_t result = 0;
+  for (const auto& encoding : encodings) {
+    const auto forest(Forest::decode(unicode
+      ? read_unicode(encoding)
+      : read_int(encoding).get_str(2)));
+    const auto drawn(forest->render(width, height));
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < width; ++x) {
+        if (image.mask.get_width() && !image.mask(x, y))
+          continue;
+        const int difference = int(image.pixels(x, y)) - int(drawn(x, y));
+        result += uint64_t(difference * difference)
+          * (weights.get_width() ? weights(x, y) : 1);
+      }
+    }
+  }
+  return result;
+}
+
+// Finds the power-of-two cell size whose encodings fit every budget with
+// the least error over the whole image, weighted like the simplifiers
+// weigh it. Every size from the smallest worth trying up to one cell for
+// the whole image is tried, one per hardware thread at a time. All the
+// candidates sample the same decoded image, but each builds its own tree.
+vector<string> search_cell_size(
+  const Image& image,
+  const MatrixView<const uint8_t>& weights,
+  const vector<size_t>& budgets,
+  const bool unicode,
+  const size_t starts,
+  const Cancellation* const cancellation,
+  size_t& cell_size
+) {
+
+  struct Attempt {
+    bool fits;
+    vector<string> outputs;
+  };
+
+  const size_t width = image.pixels.get_width();
+  const size_t height = image.pixels.get_height();
+  // Cell sizes giving more cells than this are not worth trying.
+  const size_t maximum_cells = 1 << 18;
+  size_t low = 0;
+  while ((((width - 1) >> low) + 1) * (((height - 1) >> low) + 1)
+    > maximum_cells)
+    ++low;
+  size_t high = low;
+  while (size_t(1) << high < max(width, height))
+    ++high;
+  ++high;
+
+  // The cores are shared between the sizes tried at once and the runs of
+  // each.
+  const size_t cores = max<size_t>(1, thread::hardware_concurrency());
+  vector<Attempt> attempts(high - low, Attempt{false, {}});
+  for (size_t first = low; first < high; first += cores) {
+    const size_t thread_count = min(cores, high - first);
+    exception_ptr failure;
+    mutex failure_mutex;
+    vector<thread> threads;
+    for (size_t t = 0; t < thread_count; ++t) {
+      threads.emplace_back([&, t]() {
+        const size_t shift = first + t;
+        Attempt& attempt = attempts[shift - low];
+        try {
+          Forest tree(image.pixels.view(), image.mask.view(),
+            size_t(1) << shift, weights);
+          tree.set_threads(cores / thread_count);
+          tree.merge_leaves();
+          attempt.outputs = encode_best
+            (tree, budgets, unicode, starts, cancellation);
+          attempt.fits = true;
+          for (size_t i = 0; i < budgets.size(); ++i)
+            attempt.fits = attempt.fits
+              && character_count(attempt.outputs[i], unicode) <= budgets[i];
+        } catch (const runtime_error&) {
+          attempt.fits = false;
+        } catch (...) {
+          lock_guard<mutex> lock(failure_mutex);
+          if (!failure)
+            failure = current_exception();
+        }
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+    if (failure)
+      rethrow_exception(failure);
+  }
+
+  // Decoding sets the format and thresholds, which are shared, so the
+  // sizes that fit are compared on this thread.
+  vector<string> best;
+  uint64_t best_error = UINT64_MAX;
+  for (size_t shift = low; shift < high; ++shift) {
+    Attempt& attempt = attempts[shift - low];
+    if (!attempt.fits)
+      continue;
+    const uint64_t error
+      = encoding_error(attempt.outputs, image, weights, unicode);
+    if (best.empty() || error < best_error) {
+      cell_size = size_t(1) << shift;
+      best_error = error;
+      best = move(attempt.outputs);
+    }
+  }
+
+  if (best.empty())
+    throw runtime_error("image does not fit the budget at any cell size");
+  return best;
+
+}
+
+// Decodes each encoding and reports its quality against the source image
+// on stderr.
+void print_quality(
+  const vector<string>& encodings,
+  const vector<size_t>& budgets,
+  const Image* const image,
+  const bool unicode
+) {
+  if (!image)
+    throw runtime_error("quality report needs the source image");
+  for (size_t i = 0; i < encodings.size(); ++i) {
+    const auto forest(Forest::decode(unicode
+      ? read_unicode(encodings[i])
+      : read_int(encodings[i]).get_str(2)));
+    const Quality quality
+      = measure_quality(*forest, image->pixels, image->mask);
+    cerr << "Quality at " << budgets[i] << " characters: MSE "
+      << quality.mse << ", PSNR " << quality.psnr << " dB, SSIM "
+      << quality.ssim << '\n';
+  }
+}
+
+const char* const usage =
+  "Usage: twitpng [--format plain|range|progressive|dag]\n"
+  "               [--alphabet ascii|unicode] [--simplifier random|rd]\n"
+  "               [--edge-weight weight] [--smooth-variation levels]\n"
+  "               [--weights map.png] [--roi x,y,width,height[,weight]]...\n"
+  "               [--input png|pnm|raw|qtree] [--size WIDTHxHEIGHT]\n"
+  "               [--cache cache.bin] [--save-tree image.qtree]\n"
+  "               [--budget characters[,characters...]] [--starts N]\n"
+  "               [--deadline-ms milliseconds] [--report-quality]\n"
+  "               [--target-psnr dB] [--target-ssim value]\n"
+  "               filename [cell size|auto]\n"
+  "       twitpng --decode [--size WIDTHxHEIGHT] < encoding.txt";
+
+int main(int argc, char** argv) try {
+  const auto start_time = chrono::steady_clock::now();
+  --argc;
+  ++argv;
+
+  vector<string> arguments;
+  bool decode = false;
+  bool unicode = false;
+  string input;
+  size_t raw_width = 0;
+  size_t raw_height = 0;
+  string cache_filename;
+  string tree_filename;
+  vector<size_t> budgets;
+  size_t starts = 1;
+  unique_ptr<Cancellation> cancellation;
+  bool report_quality = false;
+  QualityTarget target;
+  string weights_filename;
+  vector<WeightedRegion> regions;
+  for (int i = 0; i < argc; ++i) {
+    const string argument(argv[i]);
+    if (argument == "--decode") {
+      decode = true;
+    } else if (argument == "--format") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      const string format(argv[i]);
+      if (format == "plain")
+        QuadTree::format = QuadTree::PLAIN_FORMAT;
+      else if (format == "range")
+        QuadTree::format = QuadTree::RANGE_FORMAT;
+      else if (format == "progressive")
+        QuadTree::format = QuadTree::PROGRESSIVE_FORMAT;
+      else if (format == "dag")
+        QuadTree::format = QuadTree::DAG_FORMAT;
+      else
+        throw runtime_error("invalid format");
+    } else if (argument == "--simplifier") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      const string simplifier(argv[i]);
+      if (simplifier == "random")
+        Forest::simplifier = Forest::RANDOM_SIMPLIFIER;
+      else if (simplifier == "rd")
+        Forest::simplifier = Forest::RATE_DISTORTION_SIMPLIFIER;
+      else
+        throw runtime_error("invalid simplifier");
+    } else if (argument == "--edge-weight") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      istringstream stream(argv[i]);
+      if (!(stream >> QuadTree::edge_weight) || !stream.eof()
+        || QuadTree::edge_weight < 0)
+        throw runtime_error("invalid edge weight");
+    } else if (argument == "--smooth-variation") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      istringstream stream(argv[i]);
+      if (!isdigit(static_cast<unsigned char>(argv[i][0]))
+        || !(stream >> QuadTree::smooth_variation) || !stream.eof()
+        || QuadTree::smooth_variation > 255)
+        throw runtime_error("invalid smooth variation");
+    } else if (argument == "--weights") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      weights_filename = argv[i];
+    } else if (argument == "--roi") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      istringstream stream(argv[i]);
+      vector<string> items;
+      string item;
+      while (getline(stream, item, ','))
+        items.push_back(item);
+      if (items.size() != 4 && items.size() != 5)
+        throw runtime_error("invalid region of interest");
+      size_t fields[4];
+      for (size_t j = 0; j < 4; ++j) {
+        istringstream parser(items[j]);
+        if (items[j].empty()
+          || items[j].find_first_not_of("0123456789") != string::npos
+          || !(parser >> fields[j]))
+          throw runtime_error("invalid region of interest");
+      }
+      if (fields[2] > SIZE_MAX - fields[0]
+        || fields[3] > SIZE_MAX - fields[1])
+        throw runtime_error("invalid region of interest");
+      double weight = 4;
+      if (items.size() == 5) {
+        istringstream parser(items[4]);
+        if (!(parser >> weight) || !parser.eof()
+          || !(weight >= 0 && weight <= 255.0 / 16))
+          throw runtime_error("invalid region weight");
+      }
+      regions.push_back(WeightedRegion
+        {fields[0], fields[1], fields[2], fields[3], weight});
+    } else if (argument == "--alphabet") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      const string alphabet(argv[i]);
+      if (alphabet == "ascii")
+        unicode = false;
+      else if (alphabet == "unicode")
+        unicode = true;
+      else
+        throw runtime_error("invalid alphabet");
+    } else if (argument == "--input") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      input = argv[i];
+      if (input != "png" && input != "pnm" && input != "raw"
+        && input != "qtree")
+        throw runtime_error("invalid input type");
+    } else if (argument == "--cache") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      cache_filename = argv[i];
+    } else if (argument == "--save-tree") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      tree_filename = argv[i];
+    } else if (argument == "--budget") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      istringstream stream(argv[i]);
+      string item;
+      while (getline(stream, item, ',')) {
+        istringstream parser(item);
+        size_t budget;
+        if (!(parser >> budget) || !parser.eof() || !budget)
+          throw runtime_error("invalid budget");
+        budgets.push_back(budget);
+      }
+    } else if (argument == "--starts") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      istringstream stream(argv[i]);
+      if (!(stream >> starts) || !stream.eof() || !starts)
+        throw runtime_error("invalid number of starts");
+    } else if (argument == "--target-psnr" || argument == "--target-ssim") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      istringstream stream(argv[i]);
+      double value;
+      if (!(stream >> value) || !stream.eof() || value <= 0)
+        throw runtime_error("invalid quality target");
+      (argument == "--target-psnr" ? target.psnr : target.ssim) = value;
+    } else if (argument == "--report-quality") {
+      report_quality = true;
+    } else if (argument == "--deadline-ms") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      istringstream stream(argv[i]);
+      size_t milliseconds;
+      if (!(stream >> milliseconds) || !stream.eof())
+        throw runtime_error("invalid deadline");
+      cancellation.reset(new Cancellation
+        (start_time + chrono::milliseconds(milliseconds)));
+    } else if (argument == "--size") {
+      if (++i == argc)
+        throw runtime_error(usage);
+      istringstream stream(argv[i]);
+      char separator;
+      if (!(stream >> raw_width >> separator >> raw_height)
+        || separator != 'x' || !raw_width || !raw_height)
+        throw runtime_error("invalid size");
+    } else {
+      arguments.push_back(argument);
+    }
+  }
+
+  if (decode) {
+    if (!arguments.empty())
+      throw runtime_error(usage);
+    string encoding;
+    getline(cin, encoding);
+    const bool is_unicode = !encoding.empty() && encoding[0] & 0x80;
+    const string bits(is_unicode
+      ? read_unicode(encoding)
+      : read_int(encoding).get_str(2));
+    const auto forest(raw_width
+      ? Forest::decode(bits, Forest::maximum_nodes(raw_width, raw_height))
+      : Forest::decode(bits));
+    if (!raw_width) {
+      cout << *forest << '\n';
+      return 0;
+    }
+    const auto image(forest->render(raw_width, raw_height));
+    cout << "P5\n" << raw_width << ' ' << raw_height << "\n255\n";
+    for (size_t y = 0; y < raw_height; ++y)
+      cout.write(reinterpret_cast<const char*>(image.row(y)), raw_width);
+    return 0;
+  }
+
+  if (arguments.size() < 1 || arguments.size() > 2)
+    throw runtime_error(usage);
+
+  if (target.is_set() && !budgets.empty())
+    throw runtime_error("a quality target replaces --budget");
+  if (budgets.empty())
+    budgets.push_back(140);
+
+  size_t cell_size = 64;
+  bool automatic = false;
+  if (arguments.size() == 2) {
+    istringstream stream(arguments[1]);
+    if (arguments[1] == "auto")
+      automatic = true;
+    else if (!(stream >> cell_size) || !cell_size)
+      throw runtime_error("invalid cell size");
+  }
+
+  cerr << "Reading " << arguments[0] << '\n';
+  // The quadtree reads one pixel per cell, at every sample_step-th row and
+  // column of the source, so there is no need to decode more than that
+  // unless the source is measured against, or edges or weights are averaged
+  // over every pixel of a cell. Only what the tree reads decides the
+  // encoding, so decoding more never changes it.
+  size_t sample_step = 1;
+  while (!automatic && sample_step * 2 <= cell_size)
+    sample_step *= 2;
+  const bool full_resolution = report_quality || target.is_set()
+    || QuadTree::edge_weight || QuadTree::smooth_variation
+    || !weights_filename.empty() || !regions.empty();
+  const size_t decimation = full_resolution ? 1 : sample_step;
+  if (input.empty()) {
+    input = has_extension(arguments[0], ".pgm")
+      || has_extension(arguments[0], ".ppm")
+      || has_extension(arguments[0], ".pnm") ? "pnm"
+      : has_extension(arguments[0], ".raw")
+      || has_extension(arguments[0], ".gray") ? "raw"
+      : has_extension(arguments[0], ".qtree") ? "qtree"
+      : "png";
+  }
+  if (input == "raw" && !raw_width)
+    throw runtime_error("raw input needs --size");
+  unique_ptr<Image> image;
+  Mapping tree_file;
+  if (input == "qtree") {
+    tree_file = Mapping::file(arguments[0]);
+  } else {
+    image.reset(new Image(input == "pnm" ? read_pnm(arguments[0], decimation)
+      : input == "raw" ? read_raw(arguments[0], raw_width, raw_height)
+      : read_png(arguments[0], decimation)));
+  }
+
+  const bool has_weights = !weights_filename.empty() || !regions.empty();
+  if (has_weights && !image)
+    throw runtime_error("weights need the source image");
+  const Matrix<uint8_t> weights(has_weights
+    ? read_weights(weights_filename, regions, image->pixels.get_width(),
+      image->pixels.get_height(), image->decimation)
+    : Matrix<uint8_t>());
+
+  // Every run of the rate-distortion simplifier gives the same result.
+  if (Forest::simplifier == Forest::RATE_DISTORTION_SIMPLIFIER)
+    starts = 1;
+
+  // Encodings cut short by a deadline depend on timing, so they are
+  // neither looked up nor stored.
+  unique_ptr<Cache> cache;
+  uint64_t image_key = 0, options_key = 0;
+  if (!cache_filename.empty() && !cancellation) {
+    cache.reset(new Cache(cache_filename));
+    image_key = image
+      ? hash_matrix(image->mask, hash_matrix(image->pixels, 0))
+      : hash_bytes(tree_file.get(), tree_file.get_size(), 0);
+    if (has_weights)
+      image_key = hash_matrix(weights, image_key);
+    ostringstream options;
+    options << (automatic ? 0 : cell_size) << ' '
+      << (image ? image->decimation : 0) << ' '
+      << QuadTree::format << ' ' << unicode << ' ' << Forest::simplifier;
+    // A quality target makes one run per probe, whatever the starts.
+    options << ' ' << (target.is_set() ? 1 : starts)
+      << ' ' << target.psnr << ' ' << target.ssim
+      << ' ' << QuadTree::edge_weight << ' ' << QuadTree::smooth_variation;
+    for (const auto budget : budgets)
+      options << ' ' << budget;
+    const auto text(options.str());
+    options_key = hash_bytes(
+      reinterpret_cast<const uint8_t*>(text.data()), text.size(), 0);
+    // The cache holds encodings, not trees, so a tree to save means
+    // building it anyway.
+    string output;
+    if (tree_filename.empty()
+      && cache->find(image_key, options_key, output)) {
+      cerr << "Found in cache\n";
+      if (report_quality) {
+        vector<string> outputs;
+        istringstream lines(output);
+        for (string line; getline(lines, line);)
+          outputs.push_back(line);
+        if (target.is_set())
+          budgets[0] = character_count(outputs[0], unicode);
+        print_quality(outputs, budgets, image.get(), unicode);
+      }
+      cout << output << '\n';
+      return 0;
+    }
+  }
+
+  if (image) {
+    cerr << "Choosing thresholds\n";
+    // Thresholds come from the same samples whichever reader decoded the
+    // image and however far it decimated.
+    QuadTree::thresholds = otsu_thresholds(histogram(image->pixels,
+      image->mask, sample_step / image->decimation));
+  }
+
+  vector<string> outputs;
+  if (image && automatic) {
+    if (target.is_set())
+      throw runtime_error("a quality target needs a fixed cell size");
+    cerr << "Searching cell sizes\n";
+    outputs = search_cell_size(*image, weights, budgets, unicode, starts,
+      cancellation.get(), cell_size);
+    cerr << "Chose cell size " << cell_size << '\n';
+    if (!tree_filename.empty()) {
+      cerr << "Saving quadtree to " << tree_filename << '\n';
+      Forest tree
+        (image->pixels.view(), image->mask.view(), cell_size, weights);
+      tree.merge_leaves();
+      tree.save(tree_filename);
+    }
+  } else {
+    unique_ptr<Forest> tree;
+    if (image) {
+      cerr << "Building quadtree\n";
+      tree.reset(new Forest(image->pixels.view(), image->mask.view(),
+        cell_size / image->decimation, weights));
+
+      cerr << "Merging leaves\n";
+      tree->merge_leaves();
+    } else {
+      cerr << "Loading quadtree\n";
+      tree = Forest::load(tree_file);
+    }
+
+    if (!tree_filename.empty()) {
+      cerr << "Saving quadtree to " << tree_filename << '\n';
+      tree->save(tree_filename);
+    }
+
+    if (target.is_set()) {
+      if (!image)
+        throw runtime_error("quality target needs the source image");
+      cerr << "Searching for the shortest encoding meeting the target\n";
+      outputs.push_back
+        (encode_target(*tree, *image, unicode, target, budgets[0],
+          cancellation.get()));
+    } else {
+      cerr << "Simplifying\n";
+      outputs = encode_best
+        (*tree, budgets, unicode, starts, cancellation.get());
+    }
+  }
 
-  cerr << "Simplifying\n";
-  tree.simplify();
+  if (report_quality)
+    print_quality(outputs, budgets, image.get(), unicode);
 
-  cerr << "Encoding\n";
-  cout << show_int(tree.encode()) << '\n';
+  string output;
+  for (const auto& encoding : outputs)
+    output += (output.empty() ? "" : "\n") + encoding;
+  if (cache)
+    cache->insert(image_key, options_key, output);
+  cout << output << '\n';
 
 } catch (const exception& error) {
   cerr << error.what() << '\n';